@@ -1,42 +1,782 @@
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <cstring>
 #include <unistd.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
-#include <map>
 #include <vector>
 #include <chrono>
 #include <ctime>
 #include <ncurses.h>
 #include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <cerrno>
+#include <climits>
+#include <unordered_map>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/uio.h>
+#include <algorithm>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <strings.h>
+#include <charconv>
+#include <cstdio>
+
+#define BUF_LEN (256 * 1024)
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR)
+#define CRAWL_MAX_OPEN_FDS 512
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB | FAN_DELETE_SELF | FAN_ONDIR)
+#define JOURNAL_VERSION 2
+#define JOURNAL_INDEX_SEGMENTS 64
+#define JOURNAL_ROTATED_FILES 8
+#define JOURNAL_MAX_QUEUED (64 << 20)
+#define JOURNAL_NO_PATH UINT32_MAX
+#define JOURNAL_BLOOM_WORDS 8
+#define NS_PER_SEC 1000000000LL
+#define OUTPUT_FLUSH_BYTES (64 * 1024)
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define METRICS_FILE_INTERVAL 10
+
+// Event times are nanoseconds since the epoch (CLOCK_REALTIME).
+typedef int64_t EventTime;
+
+enum EventType {
+    EVENT_MESSAGE,
+    EVENT_CREATED,
+    EVENT_DELETED,
+    EVENT_MODIFIED,
+    EVENT_MOVED_FROM,
+    EVENT_MOVED_TO,
+    EVENT_RENAMED,
+    EVENT_ATTRIBUTES_CHANGED,
+    EVENT_UNKNOWN
+};
+
+const char* const EVENT_NAMES[] = {
+    "", "CREATED", "DELETED", "MODIFIED", "MOVED_FROM", "MOVED_TO", "RENAMED", "ATTRIBUTES_CHANGED", "UNKNOWN"
+};
+
+// One history entry. Events keep the watch descriptor and the entry name;
+// the full path is only joined when a line is printed, logged or drawn.
+// Plain messages keep their text in name and use wd -1, as do events
+// whose name already is a full path. Renames keep the old full path in
+// from. cookie links the MOVED_FROM/MOVED_TO halves of a move.
+struct EventRecord {
+    EventTime time = 0;
+    EventType type = EVENT_MESSAGE;
+    bool is_dir = false;
+    int wd = -1;
+    size_t count = 1;
+    uint32_t cookie = 0;
+    std::string name;
+    std::string from;
+};
+
+// Fixed-capacity ring of the most recent records (--history).
+struct EventHistory {
+    std::vector<EventRecord> records;
+    size_t start = 0;
+    size_t count = 0;
+    uint64_t pushed = 0;
+
+    void reserve(size_t capacity);
+    EventRecord& push();
+    EventRecord& operator[](size_t index);
+    const EventRecord& operator[](size_t index) const;
+    size_t size() const { return count; }
+};
+
+// A directory entry identified by its parent's dir id and its name.
+struct EntryKey {
+    int wd;
+    std::string name;
+
+    bool operator==(const EntryKey& other) const { return wd == other.wd && name == other.name; }
+};
+
+struct EntryKeyHash {
+    size_t operator()(const EntryKey& key) const {
+        return std::hash<std::string>()(key.name) * 31 + static_cast<size_t>(key.wd);
+    }
+};
+
+// A MODIFY held back so that repeats on the same path within the window
+// are logged once.
+struct PendingModify {
+    std::chrono::steady_clock::time_point deadline;
+    EventTime first_seen;
+    bool is_dir;
+    size_t count;
+};
+
+// A MOVED_FROM waiting for the MOVED_TO with the same cookie. The kernel
+// queues the two back to back, so if any other event or the end of the
+// read batch comes first, the entry left the monitored tree.
+struct PendingRename {
+    uint32_t cookie;
+    int dir;
+    std::string name;
+    std::string path;
+    bool is_dir;
+    EventTime time;
+};
+
+// Log lines go from the inotify thread to a writer thread through a
+// single-producer/single-consumer byte ring, so the reader never waits on
+// disk I/O. When the ring is full, lines wait in a bounded spill buffer on
+// the producer side ("delayed"). If that fills too, they are dropped and
+// the writer records the loss in the log itself. Event lines also leave a
+// mark with their read time and where they end in the stream, in a second
+// ring of the same kind; the writer samples event_latency once it has
+// written past a mark. Marks that do not fit are skipped.
+struct LatencyMark {
+    size_t end;
+    EventTime time;
+};
+
+struct LogWriter {
+    int fd = -1;
+    std::vector<char> ring;
+    size_t ring_mask = 0;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t flush_bytes = 64 * 1024;
+    long flush_ms = 200;
+    std::string spill;
+    uint64_t delayed = 0;
+    std::atomic<uint64_t> dropped{0};
+    uint64_t dropped_reported = 0;
+    std::atomic<bool> write_failed{false};
+    std::vector<LatencyMark> marks;
+    size_t marks_mask = 0;
+    alignas(64) std::atomic<size_t> marks_head{0};
+    alignas(64) std::atomic<size_t> marks_tail{0};
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+
+    ~LogWriter();
+    bool start(const std::string& path);
+    void push(const std::string& message, EventTime time);
+    void push_line(const char* data, size_t length, EventTime time);
+    void pump();
+    void stop();
+    void run();
+    bool put(const char* data, size_t length);
+    void mark(EventTime time);
+    void write_available();
+    void sample_written(size_t written);
+};
+
+// Binary journal layout (--journal). A file starts with a JournalHeader,
+// followed by blocks that each consist of a JournalBlock and a payload:
+//   PATHS   first id and count, then count full paths as (uint16 length,
+//           bytes). Ids are assigned in order and only valid in this file.
+//   EVENTS  an array of JournalRecord
+//   INDEX   a JournalIndex and one JournalSegment per EVENTS block
+//           written since the previous INDEX block
+// The header holds the offset of the newest INDEX block and each INDEX
+// block links to its predecessor. Blocks after the newest index are found
+// by scanning forward. Everything is in host byte order. Version 1 files
+// lack JournalSegment::path_bloom and are still read.
+const char JOURNAL_MAGIC[8] = {'D', 'I', 'R', 'M', 'O', 'N', 'J', 'L'};
+
+enum JournalBlockType : uint32_t {
+    JOURNAL_PATHS = 1,
+    JOURNAL_EVENTS = 2,
+    JOURNAL_INDEX = 3
+};
+
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t last_index;
+};
+
+struct JournalBlock {
+    uint32_t type;
+    uint32_t length;
+};
+
+struct JournalRecord {
+    int64_t time;
+    uint32_t path;
+    uint32_t from;
+    uint32_t count;
+    uint8_t type;
+    uint8_t is_dir;
+    uint16_t reserved;
+};
+
+// A PATHS block (if the segment added paths) and the EVENTS block after it.
+// type_mask has bit (1 << EventType) set for every type in the block.
+// path_bloom is a Bloom filter of every path in the block (old paths of
+// renames included) and of each of their parent directories, so --path
+// can skip segments with nothing below the prefix. All bits are set when
+// the paths are unknown.
+struct JournalSegment {
+    uint64_t events_offset;
+    uint64_t paths_offset;
+    int64_t min_time;
+    int64_t max_time;
+    uint32_t records;
+    uint32_t type_mask;
+    uint64_t path_bloom[JOURNAL_BLOOM_WORDS];
+};
+
+// JournalSegment as written by version 1.
+#define JOURNAL_SEGMENT_V1_SIZE offsetof(JournalSegment, path_bloom)
+
+// max_time covers this index and all earlier ones, so a backwards walk can
+// stop at the first index that ends before the queried range.
+struct JournalIndex {
+    uint64_t previous;
+    int64_t max_time;
+    uint32_t segments;
+    uint32_t reserved;
+};
+
+// An event as queued for the journal thread: the header is followed by
+// the full path and, for renames, the old path.
+struct JournalPending {
+    int64_t time;
+    uint32_t count;
+    uint16_t path_length;
+    uint16_t from_length;
+    uint8_t type;
+    uint8_t is_dir;
+};
+
+// Reads the segment list of one journal file: all indexed segments
+// followed by the tail_segments written after the newest index, which
+// end at valid_end.
+struct JournalReader {
+    int fd = -1;
+    uint64_t size = 0;
+    uint64_t valid_end = 0;
+    uint64_t last_index = 0;
+    uint32_t version = 0;
+    int64_t max_time = INT64_MIN;
+    std::vector<JournalSegment> segments;
+    size_t tail_segments = 0;
+
+    bool load(int journal_fd, std::string& error);
+    bool read_block(uint64_t offset, uint32_t type, std::vector<char>& payload);
+    bool read_paths(uint64_t until, std::vector<std::string>& paths);
+};
+
+// Writes the journal on its own thread. The inotify thread only appends
+// JournalPending entries to staging and hands them over once per loop
+// iteration. The writer interns paths, encodes records, appends one
+// segment per flush, adds an index block every JOURNAL_INDEX_SEGMENTS
+// segments and rotates the file once it reaches max_size.
+struct JournalWriter {
+    bool enabled = false;
+    std::string path;
+    uint64_t max_size = 256 << 20;
+    long flush_ms = 200;
+    size_t flush_bytes = 64 * 1024;
+    std::string staging;
+    size_t staged = 0;
+    uint64_t dropped = 0;
+    std::atomic<bool> write_failed{false};
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::string queued;
+    bool stopping = false;
+    std::thread thread;
+
+    // Owned by the writer thread once started.
+    int fd = -1;
+    uint64_t offset = 0;
+    uint64_t last_index = 0;
+    int64_t max_time = INT64_MIN;
+    std::unordered_map<std::string, uint32_t> path_ids;
+    std::vector<JournalSegment> segments;
+    std::string block;
+
+    ~JournalWriter();
+    bool start(const std::string& path, std::string& error);
+    void push(const EventRecord& record);
+    void pump();
+    void stop();
+    void run();
+    bool open_file(std::string& error);
+    void write_segment(const std::string& batch);
+    uint32_t intern(const char* data, size_t length, std::string& paths, uint32_t& added);
+    void write_index();
+    void rotate();
+    void shift_files();
+    void write_at(const void* data, size_t length, uint64_t at);
+};
 
-#define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+// --query filters. until is exclusive.
+struct JournalQuery {
+    int64_t since = INT64_MIN;
+    int64_t until = INT64_MAX;
+    std::string prefix;
+    uint32_t type_mask = UINT32_MAX;
+};
+
+// Watched directories form a tree: each entry stores its parent's id and
+// its own name (the full path for entries without a parent), so renaming
+// a directory updates a single entry. Full paths are cached per entry and
+// rebuilt lazily after any directory rename.
+struct WatchEntry {
+    int parent = -1;
+    std::string name;
+    int depth = 0;
+    bool removed = false;
+    std::string path;
+    uint64_t path_generation = 0;
+};
+
+// A directory waiting to be read by the crawler. fd is a descriptor that
+// was already opened with openat() on the parent, or -1 to open by path.
+struct CrawlItem {
+    std::string path;
+    int depth;
+    int fd;
+};
+
+struct CrawlDir {
+    std::string path;
+    int depth;
+    int wd;
+};
+
+// Metadata of one entry, keyed by name in its SnapshotDir. Entries
+// updated from events rather than stat() are dirty: only their existence
+// is known to be current.
+struct SnapshotEntry {
+    struct timespec mtime;
+    off_t size;
+    ino_t inode;
+    bool is_dir;
+    bool dirty;
+};
+
+// One directory of a Snapshot. mtime is the directory's own mtime when it
+// was last listed; a directory that was created or moved in since then is
+// not listed, and its entries only come from events.
+struct SnapshotDir {
+    struct timespec mtime = {0, 0};
+    int depth = 0;
+    bool listed = false;
+    std::unordered_map<std::string, SnapshotEntry> entries;
+};
+
+// Keyed by full directory path. The ordering keeps each subtree in one
+// range, so that renames and removals only touch the affected directories.
+typedef std::map<std::string, SnapshotDir> Snapshot;
+
+enum FilterMatch {
+    FILTER_LITERAL,
+    FILTER_SUFFIX,
+    FILTER_PREFIX,
+    FILTER_GLOB
+};
+
+// One --exclude/--include rule. Globs of the form "name", "*suffix" and
+// "prefix*" are compared directly instead of going through glob_match().
+struct FilterRule {
+    std::string pattern;
+    std::string literal;
+    FilterMatch match;
+    bool include;
+    bool dir_only;
+    bool anchored;
+};
+
+// --exclude, --include and --exclude-from rules with gitignore semantics,
+// in command line order. Excluded directories are neither watched nor
+// scanned, and events on excluded entries are dropped.
+struct PathFilter {
+    std::vector<FilterRule> rules;
+    bool anchored = false;
+
+    void add(std::string pattern, bool include);
+    bool load(const std::string& path);
+    bool excluded(const char* relative, const char* name, bool is_dir) const;
+    bool excluded_path(const char* path, bool is_dir) const;
+    bool excluded_directory(const char* path) const;
+};
+
+// Walks a tree with a pool of threads that share a LIFO queue of
+// directories. Entry types come from d_type. fstatat() is only called
+// for DT_UNKNOWN entries and for entries recorded in a snapshot.
+// Children are opened with openat() relative to the parent's fd, and
+// symlinks are never followed. Depending on the fields below, a crawl
+// adds watches, records every directory, and collects metadata for
+// entries below a given depth.
+struct Crawler {
+    int inotify_fd = -1;
+    int watch_levels = 0;
+    bool descend_all = true;
+    int collect_from = -1;
+    size_t jobs = 1;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<CrawlItem> queue;
+    size_t active = 0;
+    std::atomic<size_t> open_fds{0};
+    std::atomic<size_t> dirs_scanned{0};
+    std::atomic<size_t> watches_added{0};
+    std::atomic<bool> limit_reached{false};
+    std::atomic<size_t> dirs_excluded{0};
+    std::vector<CrawlDir> dirs;
+    Snapshot entries;
+    std::vector<std::string> warnings;
+
+    void run(const std::string& root, int root_depth, bool report_progress);
+    void work();
+    void scan(const CrawlItem& item, std::vector<CrawlItem>& children, std::vector<CrawlDir>& found,
+              std::vector<std::pair<std::string, SnapshotDir>>& collected, std::vector<std::string>& errors);
+};
+
+// An event as delivered by any backend. mask uses the IN_* bits, which
+// fanotify's FAN_* event bits share. dir indexes the watches table.
+struct SourceEvent {
+    uint32_t mask;
+    uint32_t cookie;
+    int dir;
+    const char* name;
+};
+
+// Where filesystem events come from. start() throws std::runtime_error
+// when the backend cannot be used. read_events() drains everything that
+// is ready on poll_fd() into handle_event() and returns false on a fatal
+// error.
+struct EventSource {
+    virtual ~EventSource() {}
+    virtual const char* name() const = 0;
+    virtual void start(const std::string& root) = 0;
+    virtual int poll_fd() const = 0;
+    virtual bool read_events(EventTime batch_time) = 0;
+    virtual void directory_created(int parent, const std::string& path) = 0;
+    virtual void directory_renamed(int from_dir, const std::string& from_name, int to_dir, const std::string& to_name) = 0;
+    virtual void directory_moved_out(int dir, const std::string& name) = 0;
+};
+
+// One watch per directory; dir ids are inotify watch descriptors.
+struct InotifySource : EventSource {
+    int fd = -1;
+
+    ~InotifySource();
+    const char* name() const override { return "inotify"; }
+    void start(const std::string& root) override;
+    int poll_fd() const override { return fd; }
+    bool read_events(EventTime batch_time) override;
+    void directory_created(int parent, const std::string& path) override;
+    void directory_renamed(int from_dir, const std::string& from_name, int to_dir, const std::string& to_name) override;
+    void directory_moved_out(int dir, const std::string& name) override;
+};
+
+// A single fanotify mark on the filesystem that contains the root, with
+// events reported as directory file handle plus entry name. Each
+// directory handle is resolved to a path once and then gets a dir id.
+// Any directory rename retires those ids so that paths are resolved
+// again. Events outside the root are discarded. Needs CAP_SYS_ADMIN.
+struct FanotifySource : EventSource {
+    int fd = -1;
+    int mount_fd = -1;
+    std::string root;
+    std::string real_root;
+    std::unordered_map<std::string, int> directory_ids;
+    int next_id = 1;
+    uint32_t next_cookie = 1;
+
+    ~FanotifySource();
+    const char* name() const override { return "fanotify"; }
+    void start(const std::string& root) override;
+    int poll_fd() const override { return fd; }
+    bool read_events(EventTime batch_time) override;
+    void directory_created(int, const std::string&) override {}
+    void directory_renamed(int, const std::string&, int, const std::string&) override { forget_directories(); }
+    void directory_moved_out(int, const std::string&) override { forget_directories(); }
+    void emit(const struct fanotify_event_info_fid* info, uint32_t mask, uint32_t cookie, EventTime batch_time);
+    int directory_id(const struct fanotify_event_info_fid* info, bool resolve);
+    void forget_directories();
+    void forget_outside_directories();
+};
+
+// Log-linear histogram in the style of HdrHistogram: values below 16 get
+// a bucket each, and every power of two above that is split into 16
+// buckets, so a bucket is never wider than 1/16 of its smallest value.
+// record() is a relaxed atomic increment and safe from any thread.
+struct Histogram {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+
+    void record(uint64_t value);
+    void snapshot(std::vector<uint64_t>& counts) const;
+    static size_t index(uint64_t value);
+    static uint64_t lowest(size_t index);
+    static uint64_t highest(size_t index);
+};
+
+// Counters behind --stats-interval, --metrics-file and the curses status
+// line. event_latency runs from the read() that returned an event until
+// its line is written to the log file, including the time it queued for
+// the log writer. Without a log file it ends at the write to stdout (or
+// the handoff to the curses view); unflushed then holds the read times of
+// lines still in output_buffer. Only the log writer records off the main
+// thread: write_latency, and event_latency with a log file.
+struct Metrics {
+    uint64_t events[EVENT_UNKNOWN + 1] = {};
+    Histogram batch_sizes;
+    Histogram event_latency;
+    Histogram write_latency;
+    std::vector<EventTime> unflushed;
+};
+
+// The metrics at one point in time, or the difference between two.
+struct MetricsSample {
+    std::chrono::steady_clock::time_point time;
+    uint64_t events[EVENT_UNKNOWN + 1] = {};
+    uint64_t overflows = 0;
+    std::vector<uint64_t> batch_sizes;
+    std::vector<uint64_t> event_latency;
+    std::vector<uint64_t> write_latency;
+
+    void take();
+    void subtract(const MetricsSample& earlier);
+    uint64_t total_events() const;
+};
+
+// What changed over the last period: one --stats-interval for the stderr
+// summary, one second for the curses status line.
+struct MetricsWindow {
+    MetricsSample previous;
+    MetricsSample delta;
+    double seconds = 0;
+
+    void advance();
+    double rate(uint64_t count) const { return seconds > 0 ? count / seconds : 0; }
+};
+
+// Starts a thread with all signals blocked, so that signals are only
+// ever handled by the main thread.
+template <typename... Args>
+std::thread start_thread(Args&&... args) {
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    std::thread thread(std::forward<Args>(args)...);
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    return thread;
+}
 
 bool use_curses = false;
-std::ofstream log_file;
-std::map<int, std::string> watch_descriptors;
+// Lines for stdout go into output_buffer, which is written once per loop
+// iteration or when it grows past OUTPUT_FLUSH_BYTES. With --format=jsonl
+// events are encoded there directly and messages go to stderr.
+bool json_output = false;
+std::string output_buffer;
+LogWriter log_writer;
+JournalWriter journal;
+std::string backend = "auto";
+std::string monitor_root;
+PathFilter path_filter;
+std::unique_ptr<EventSource> event_source;
+alignas(8) char event_buffer[BUF_LEN];
+volatile sig_atomic_t interrupted = 0;
+// The main loop waits on epoll_fd for the event source, signal_fd
+// (SIGINT, SIGTERM, SIGWINCH), timer_fd (the next deadline from
+// next_wakeup_ms()) and, in curses mode, keys on stdin.
+int epoll_fd = -1;
+int signal_fd = -1;
+int timer_fd = -1;
+// Watched directories by dir id, the (parent, name) index used to find a
+// moved directory, and ids dropped since the last batch.
+std::unordered_map<int, WatchEntry> watches;
+std::unordered_map<EntryKey, int, EntryKeyHash> watch_children;
+uint64_t path_generation = 1;
+std::vector<int> removed_watches;
+size_t crawl_jobs = 0;
+long max_user_watches = -1;
+// Degraded mode: only directories less than watch_levels deep are watched
+// (0 = all). Deeper entries are compared against tree_snapshot every
+// rescan_interval seconds.
+int watch_levels = 0;
+long rescan_interval = 60;
+std::chrono::steady_clock::time_point next_rescan;
+// With --snapshot, tree_snapshot covers the whole tree and is kept current
+// from events, so that a queue overflow can be repaired by listing the
+// directories that changed and logging the differences. Building it
+// stat()s every entry, so it is off by default.
+bool keep_snapshot = false;
+Snapshot tree_snapshot;
+size_t overflow_count = 0;
+bool overflow_pending = false;
+// --stats-interval prints a summary every stats_interval seconds (0 = never)
+// and --metrics-file rewrites metrics_path as often, or every
+// METRICS_FILE_INTERVAL seconds without --stats-interval.
+Metrics metrics;
+long stats_interval = 0;
+std::string metrics_path;
+MetricsWindow stats_window;
+MetricsWindow status_window;
+std::chrono::steady_clock::time_point next_stats;
+std::chrono::steady_clock::time_point next_status;
+std::chrono::steady_clock::time_point next_metrics_write;
 size_t max_log_lines = 1000;
-std::vector<std::string> log_history;
+EventHistory log_history;
+long coalesce_ms = 100;
+int ui_fps = 20;
+std::unordered_map<EntryKey, PendingModify, EntryKeyHash> pending_modifies;
+std::vector<PendingRename> pending_renames;
+bool display_dirty = false;
+std::chrono::steady_clock::time_point last_redraw;
+// Curses view state. While paused or scrolled back the view stays on the
+// same lines; scroll_offset counts the matching lines below it, and
+// view_pushed is the history position at the last redraw. Only lines
+// containing view_filter are shown. filter_edit holds the filter while
+// it is typed.
+bool ui_paused = false;
+size_t paused_new = 0;
+size_t scroll_offset = 0;
+uint64_t view_pushed = 0;
+std::string view_filter;
+std::string filter_edit;
+bool editing_filter = false;
 
-void add_watch_recursive(int fd, const std::string& path);
+void add_watch_recursive(int fd, int parent, const std::string& path, int depth);
+void watch_initial_tree(int fd, const std::string& root);
+void register_watches(const std::vector<CrawlDir>& dirs, int root_parent);
+void set_watch(int wd, int parent, const std::string& name, int depth);
+void remove_watch(int wd);
+void retire_removed_watches();
+void rescan_tree(const std::string& root, int min_depth, bool emit_events);
+void rescan_changed_directories(const std::string& root);
+void add_change(std::vector<std::pair<std::string, EventRecord>>& changes, EventType type, std::string path, bool is_dir);
+bool snapshot_changed(const SnapshotEntry& known, const SnapshotEntry& current);
+void log_changes(std::vector<std::pair<std::string, EventRecord>>& changes);
+int root_watch(const std::string& root);
+int find_watch(int wd, const std::string& root, const std::string& path);
+int snapshot_depth();
+void update_snapshot(const SourceEvent& event, bool is_dir);
+void erase_snapshot_subtree(const std::string& path);
+void snapshot_move(const std::string& from, const std::string& to, bool is_dir);
+void snapshot_remove(const std::string& path, bool is_dir);
+void queue_overflowed();
+long read_max_user_watches();
+void report_crawl_progress(size_t dirs, size_t watched, bool done);
+std::unique_ptr<EventSource> open_event_source(const std::string& root);
+void handle_event(const SourceEvent& event, EventTime batch_time);
+bool event_excluded(const SourceEvent& event, bool is_dir);
+bool glob_match(const char* pattern, const char* text);
+const char* relative_path(const char* path);
+void log_event(EventType type, bool is_dir, int wd, const char* name, EventTime when, size_t count = 1, uint32_t cookie = 0);
+void log_rename(const PendingRename& from, int wd, const char* name, EventTime when);
+std::string entry_path(int wd, const std::string& name);
+void log_record(const EventRecord& record);
+std::string format_record(const EventRecord& record);
+void append_json_record(std::string& out, const EventRecord& record);
+void append_json_string(std::string& out, const char* data, size_t length);
+void append_decimal(std::string& out, long long value);
+void flush_output();
+int run_benchmark(size_t events);
+const std::string& watch_path(int wd);
+void flush_pending_modifies(bool force);
+void flush_pending_modify(const EntryKey& key);
+void flush_pending_renames();
+bool pairs_pending_rename(const SourceEvent& event);
+int next_wakeup_ms();
 void log_message(const std::string& message);
+uint64_t histogram_percentile(const std::vector<uint64_t>& counts, unsigned permille);
+void record_event_latency(EventTime read_time, EventTime now);
+void start_metrics();
+void update_metrics();
+std::chrono::steady_clock::time_point next_metrics_update();
+std::string format_duration(uint64_t ns);
+std::string format_rate(double rate);
+void report_stats();
+void append_prometheus_histogram(std::string& out, const char* name, const char* help, const Histogram& histogram,
+                                 const uint64_t* bounds, size_t bound_count, double scale);
+void append_prometheus_counter(std::string& out, const char* name, const char* type, const char* help, uint64_t value);
+bool write_metrics_file(std::string& error);
+int run_query(const std::string& path, const JournalQuery& query);
+void query_file(const std::string& path, const JournalQuery& query);
+bool path_has_prefix(const std::string& path, const std::string& prefix);
+void bloom_bits(const char* data, size_t length, size_t bits[2]);
+void bloom_add_path(uint64_t* bloom, const char* path, size_t length);
+bool bloom_has_prefix(const uint64_t* bloom, const std::string& prefix);
+bool parse_time(const char* text, int64_t& result);
+bool parse_event_types(const char* text, uint32_t& mask);
+bool parse_size(const char* text, uint64_t& result);
+void signal_handler(int signum);
+bool setup_event_loop();
+void arm_timer(int delay_ms);
+bool handle_signals();
+bool handle_keys();
 void print_usage();
 void setup_curses();
 void cleanup_curses();
 void update_curses_display();
+void maybe_update_curses_display();
+void redraw_curses_display();
+void resize_curses();
+bool record_visible(const EventRecord& record);
 std::string get_current_time();
+EventTime event_clock();
+const std::string& format_timestamp(time_t when);
 
 int main(int argc, char* argv[]) {
     std::string directory;
     std::string log_file_path;
+    std::string journal_path;
+    bool query_mode = false;
+    bool query_filters = false;
+    size_t benchmark_events = 0;
+    JournalQuery query;
 
     static struct option long_options[] = {
         {"log-file", required_argument, 0, 'l'},
         {"curses", no_argument, 0, 'c'},
+        {"coalesce-ms", required_argument, 0, 'w'},
+        {"fps", required_argument, 0, 'f'},
+        {"flush-ms", required_argument, 0, 'M'},
+        {"flush-bytes", required_argument, 0, 'B'},
+        {"history", required_argument, 0, 'H'},
+        {"jobs", required_argument, 0, 'j'},
+        {"watch-depth", required_argument, 0, 'd'},
+        {"rescan-interval", required_argument, 0, 'r'},
+        {"backend", required_argument, 0, 'b'},
+        {"snapshot", no_argument, 0, 'S'},
+        {"format", required_argument, 0, 'F'},
+        {"benchmark", required_argument, 0, 'X'},
+        {"exclude", required_argument, 0, 'x'},
+        {"include", required_argument, 0, 'i'},
+        {"exclude-from", required_argument, 0, 'E'},
+        {"journal", required_argument, 0, 'J'},
+        {"journal-size", required_argument, 0, 'Z'},
+        {"query", no_argument, 0, 'q'},
+        {"since", required_argument, 0, 's'},
+        {"until", required_argument, 0, 'u'},
+        {"path", required_argument, 0, 'p'},
+        {"type", required_argument, 0, 't'},
+        {"stats-interval", required_argument, 0, 'I'},
+        {"metrics-file", required_argument, 0, 'P'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -44,7 +784,7 @@ int main(int argc, char* argv[]) {
     int opt;
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "l:ch", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "l:cw:f:M:B:H:j:d:r:b:SF:X:x:i:E:J:Z:qs:u:p:t:I:P:h", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'l':
                 log_file_path = optarg;
@@ -52,6 +792,100 @@ int main(int argc, char* argv[]) {
             case 'c':
                 use_curses = true;
                 break;
+            case 'w':
+                coalesce_ms = std::max(0L, atol(optarg));
+                break;
+            case 'f':
+                ui_fps = std::max(1, atoi(optarg));
+                break;
+            case 'M':
+                log_writer.flush_ms = std::max(1L, atol(optarg));
+                break;
+            case 'B':
+                log_writer.flush_bytes = std::max(1L, atol(optarg));
+                break;
+            case 'H':
+                max_log_lines = std::max(1L, atol(optarg));
+                break;
+            case 'j':
+                crawl_jobs = std::max(1, atoi(optarg));
+                break;
+            case 'd':
+                watch_levels = std::max(0, atoi(optarg));
+                break;
+            case 'r':
+                rescan_interval = std::max(1L, atol(optarg));
+                break;
+            case 'S':
+                keep_snapshot = true;
+                break;
+            case 'F':
+                if (strcmp(optarg, "jsonl") == 0) {
+                    json_output = true;
+                } else if (strcmp(optarg, "text") != 0) {
+                    std::cerr << "Error: Unknown format " << optarg << std::endl;
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'X':
+                benchmark_events = std::max(1L, atol(optarg));
+                break;
+            case 'x':
+            case 'i':
+                path_filter.add(optarg, opt == 'i');
+                break;
+            case 'E':
+                if (!path_filter.load(optarg)) {
+                    std::cerr << "Error: Could not read " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'Z':
+                if (!parse_size(optarg, journal.max_size)) {
+                    std::cerr << "Error: Invalid journal size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'q':
+                query_mode = true;
+                break;
+            case 's':
+            case 'u':
+                if (!parse_time(optarg, opt == 's' ? query.since : query.until)) {
+                    std::cerr << "Error: Invalid time " << optarg << " (expected [YYYY-MM-DD] HH:MM[:SS] or @SECONDS)" << std::endl;
+                    return 1;
+                }
+                query_filters = true;
+                break;
+            case 'p':
+                query.prefix = optarg;
+                query_filters = true;
+                break;
+            case 't':
+                if (!parse_event_types(optarg, query.type_mask)) {
+                    std::cerr << "Error: Unknown event type in " << optarg << std::endl;
+                    return 1;
+                }
+                query_filters = true;
+                break;
+            case 'I':
+                stats_interval = std::max(1L, atol(optarg));
+                break;
+            case 'P':
+                metrics_path = optarg;
+                break;
+            case 'b':
+                backend = optarg;
+                if (backend != "auto" && backend != "inotify" && backend != "fanotify") {
+                    std::cerr << "Error: Unknown backend " << backend << std::endl;
+                    print_usage();
+                    return 1;
+                }
+                break;
             case 'h':
                 print_usage();
                 return 0;
@@ -61,247 +895,3589 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (query_mode) {
+        if (optind >= argc) {
+            std::cerr << "Error: No journal specified." << std::endl;
+            print_usage();
+            return 1;
+        }
+        return run_query(argv[optind], query);
+    }
+    if (query_filters) {
+        std::cerr << "Error: --since, --until, --path and --type require --query." << std::endl;
+        return 1;
+    }
+
     if (optind < argc) {
         directory = argv[optind];
-    } else {
+    } else if (benchmark_events == 0) {
         std::cerr << "Error: No directory specified." << std::endl;
         print_usage();
         return 1;
     }
 
     struct stat st;
-    if (stat(directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    if (benchmark_events == 0 && (stat(directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))) {
         std::cerr << "Error: " << directory << " is not a valid directory." << std::endl;
         return 1;
     }
 
     if (!log_file_path.empty()) {
-        log_file.open(log_file_path, std::ios::out | std::ios::app);
-        if (!log_file.is_open()) {
+        if (!log_writer.start(log_file_path)) {
             std::cerr << "Error: Could not open log file " << log_file_path << std::endl;
             return 1;
         }
     }
 
+    if (!journal_path.empty()) {
+        std::string error;
+        journal.flush_ms = log_writer.flush_ms;
+        journal.flush_bytes = log_writer.flush_bytes;
+        if (!journal.start(journal_path, error)) {
+            std::cerr << "Error: Could not open journal " << journal_path << ": " << error << std::endl;
+            return 1;
+        }
+    }
+
+    log_history.reserve(max_log_lines);
+    if (!use_curses) {
+        output_buffer.reserve(2 * OUTPUT_FLUSH_BYTES);
+    }
+
+    if (!metrics_path.empty()) {
+        std::string error;
+        if (!write_metrics_file(error)) {
+            std::cerr << "Error: Could not write metrics file " << metrics_path << ": " << error << std::endl;
+            return 1;
+        }
+    }
+
+    if (benchmark_events > 0) {
+        int status = run_benchmark(benchmark_events);
+        journal.stop();
+        log_writer.stop();
+        return status;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
     if (use_curses) {
         setup_curses();
     }
 
-    int fd = inotify_init();
-    if (fd < 0) {
-        log_message("Error: Could not initialize inotify");
-        if (use_curses) cleanup_curses();
-        return 1;
+    if (crawl_jobs == 0) {
+        crawl_jobs = std::max(1u, std::thread::hardware_concurrency());
     }
 
+    monitor_root = directory;
     try {
-        add_watch_recursive(fd, directory);
+        event_source = open_event_source(directory);
     } catch (const std::exception& e) {
         log_message(std::string("Error: ") + e.what());
         if (use_curses) cleanup_curses();
-        close(fd);
         return 1;
     }
 
-    log_message("Monitoring directory: " + directory);
-    log_message("Press Ctrl+C to exit");
+    log_message("Monitoring directory: " + directory + " (" + event_source->name() + ")");
+    log_message(use_curses ? "Press q or Ctrl+C to exit" : "Press Ctrl+C to exit");
 
-    char buffer[BUF_LEN];
-    while (true) {
-        int length = read(fd, buffer, BUF_LEN);
-        if (length < 0) {
-            log_message("Error: Could not read inotify events");
+    // Each wakeup drains the queue completely, then handles coalescing
+    // deadlines and a redraw that is limited to --fps.
+    bool running = setup_event_loop();
+    start_metrics();
+    while (running && !interrupted) {
+        arm_timer(next_wakeup_ms());
+        struct epoll_event ready[4];
+        int count = epoll_wait(epoll_fd, ready, 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message("Error: Could not wait for events");
             break;
         }
 
-        int i = 0;
-        while (i < length) {
-            struct inotify_event* event = (struct inotify_event*)&buffer[i];
-
-            if (event->len) {
-                std::string path = watch_descriptors[event->wd];
-                std::string filename = event->name;
-                std::string fullpath = path + "/" + filename;
-                std::string event_type;
-
-                if (event->mask & IN_CREATE) {
-                    event_type = "CREATED";
-
-                    if (event->mask & IN_ISDIR) {
-                        try {
-                            add_watch_recursive(fd, fullpath);
-                        } catch (const std::exception& e) {
-                            log_message(std::string("Error adding watch: ") + e.what());
-                        }
-                    }
-                } else if (event->mask & IN_DELETE) {
-                    event_type = "DELETED";
-                } else if (event->mask & IN_MODIFY) {
-                    event_type = "MODIFIED";
-                } else if (event->mask & IN_MOVED_FROM) {
-                    event_type = "MOVED_FROM";
-                } else if (event->mask & IN_MOVED_TO) {
-                    event_type = "MOVED_TO";
-                } else if (event->mask & IN_ATTRIB) {
-                    event_type = "ATTRIBUTES_CHANGED";
-                } else {
-                    event_type = "UNKNOWN";
+        bool have_events = false;
+        for (int i = 0; i < count; i++) {
+            int fd = ready[i].data.fd;
+            if (fd == signal_fd) {
+                running = handle_signals() && running;
+            } else if (fd == timer_fd) {
+                uint64_t expirations;
+                while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
                 }
-
-                std::string dir_or_file = (event->mask & IN_ISDIR) ? "directory" : "file";
-                std::string message = get_current_time() + " " + event_type + " " + dir_or_file + ": " + fullpath;
-                log_message(message);
+            } else if (fd == STDIN_FILENO) {
+                running = handle_keys() && running;
+            } else {
+                have_events = true;
             }
+        }
 
-            i += sizeof(struct inotify_event) + event->len;
+        if (have_events && !event_source->read_events(event_clock())) {
+            running = false;
         }
 
+        flush_pending_renames();
+        retire_removed_watches();
+        flush_pending_modifies(false);
+        if (overflow_pending) {
+            overflow_pending = false;
+            if (snapshot_depth() == 0) {
+                log_message("Warning: Event queue overflowed (" + std::to_string(overflow_count) +
+                            " so far); rescanning changed directories");
+                rescan_changed_directories(directory);
+            } else {
+                log_message("Warning: Event queue overflowed (" + std::to_string(overflow_count) +
+                            " so far); events were lost. Use --snapshot to recover them.");
+            }
+        } else if (watch_levels > 0 && std::chrono::steady_clock::now() >= next_rescan) {
+            rescan_tree(directory, watch_levels, true);
+        }
+        log_writer.pump();
+        journal.pump();
+        flush_output();
+        update_metrics();
         if (use_curses) {
-            update_curses_display();
+            maybe_update_curses_display();
         }
     }
+    flush_pending_renames();
+    flush_pending_modifies(true);
+    flush_output();
+    if (!metrics_path.empty()) {
+        std::string error;
+        write_metrics_file(error);
+    }
 
-    close(fd);
-    if (log_file.is_open()) {
-        log_file.close();
+    event_source.reset();
+    journal.stop();
+    log_writer.stop();
+    for (int fd : {epoll_fd, signal_fd, timer_fd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
     }
     if (use_curses) {
         cleanup_curses();
     }
+    if (log_writer.delayed || log_writer.dropped) {
+        std::cerr << "Log writer: " << log_writer.delayed << " lines delayed, "
+                  << log_writer.dropped << " lines dropped (buffer full)" << std::endl;
+    }
+    if (log_writer.write_failed) {
+        std::cerr << "Warning: Writing to the log file failed; some lines were lost" << std::endl;
+    }
+    if (journal.dropped) {
+        std::cerr << "Journal: " << journal.dropped << " events dropped (writer too slow)" << std::endl;
+    }
+    if (journal.write_failed) {
+        std::cerr << "Warning: Writing to the journal failed; some events were lost" << std::endl;
+    }
 
     return 0;
 }
 
-void add_watch_recursive(int fd, const std::string& path) {
-    DIR* dir = opendir(path.c_str());
-    if (!dir) {
-        throw std::runtime_error("Could not open directory: " + path);
-    }
+// Watches a directory created while monitoring, and everything below it
+// within the watched depth.
+void add_watch_recursive(int fd, int parent, const std::string& path, int depth) {
+    Crawler crawler;
+    crawler.inotify_fd = fd;
+    crawler.watch_levels = watch_levels;
+    crawler.descend_all = false;
+    crawler.run(path, depth, false);
 
-    uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB;
-    int wd = inotify_add_watch(fd, path.c_str(), mask);
-    if (wd < 0) {
-        closedir(dir);
-        throw std::runtime_error("Could not add watch for: " + path);
+    register_watches(crawler.dirs, parent);
+    for (const std::string& warning : crawler.warnings) {
+        log_message("Warning: " + warning);
     }
+    if (crawler.limit_reached) {
+        throw std::runtime_error("Watch limit reached below: " + path);
+    }
+}
 
-    watch_descriptors[wd] = path;
+// Sets up the watches for the monitored tree in parallel. If the tree
+// needs more watches than fs.inotify.max_user_watches allows, this falls
+// back to watching only the top levels that fit, and deeper subtrees are
+// rescanned periodically instead.
+void watch_initial_tree(int fd, const std::string& root) {
+    max_user_watches = read_max_user_watches();
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    Crawler crawler;
+    crawler.inotify_fd = fd;
+    crawler.watch_levels = watch_levels;
+    crawler.descend_all = watch_levels == 0;
+    crawler.collect_from = keep_snapshot && watch_levels == 0 ? 0 : -1;
+    crawler.jobs = crawl_jobs;
+    crawler.run(root, 0, true);
+
+    if (crawler.dirs.empty() || (crawler.dirs[0].wd < 0 && !crawler.limit_reached)) {
+        throw std::runtime_error("Could not add watch for: " + root);
+    }
+
+    if (crawler.limit_reached && watch_levels == 0) {
+        // Keep the deepest complete set of levels that fits in the watches
+        // the kernel actually granted.
+        std::vector<size_t> per_depth;
+        for (const CrawlDir& dir : crawler.dirs) {
+            if (static_cast<size_t>(dir.depth) >= per_depth.size()) {
+                per_depth.resize(dir.depth + 1);
+            }
+            per_depth[dir.depth]++;
         }
+        size_t granted = crawler.watches_added;
+        size_t used = 0;
+        int levels = 0;
+        while (static_cast<size_t>(levels) < per_depth.size() && used + per_depth[levels] <= granted) {
+            used += per_depth[levels];
+            levels++;
+        }
+        watch_levels = std::max(1, levels);
 
-        std::string full_path = path + "/" + entry->d_name;
-        struct stat st;
-        if (stat(full_path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
-            try {
-                add_watch_recursive(fd, full_path);
-            } catch (const std::exception& e) {
-                std::cerr << "Warning: " << e.what() << std::endl;
+        for (CrawlDir& dir : crawler.dirs) {
+            if (dir.wd >= 0 && dir.depth >= watch_levels) {
+                inotify_rm_watch(fd, dir.wd);
+                dir.wd = -1;
             }
         }
-    }
+        for (CrawlDir& dir : crawler.dirs) {
+            if (dir.wd < 0 && dir.depth < watch_levels) {
+                dir.wd = inotify_add_watch(fd, dir.path.c_str(), WATCH_MASK);
+            }
+        }
+        if (crawler.dirs[0].wd < 0) {
+            throw std::runtime_error("Could not add watch for: " + root);
+        }
 
-    closedir(dir);
-}
+        log_message("Warning: " + std::to_string(crawler.dirs.size()) + " directories exceed the inotify watch limit (" +
+                    std::to_string(max_user_watches) + "); watching the top " + std::to_string(watch_levels) +
+                    " levels and rescanning deeper directories every " + std::to_string(rescan_interval) +
+                    "s. Raise fs.inotify.max_user_watches or use --watch-depth.");
+    }
 
-void log_message(const std::string& message) {
-    log_history.push_back(message);
-    if (log_history.size() > max_log_lines) {
-        log_history.erase(log_history.begin());
+    register_watches(crawler.dirs, -1);
+    size_t watched = watches.size();
+    for (const std::string& warning : crawler.warnings) {
+        log_message("Warning: " + warning);
     }
 
-    if (log_file.is_open()) {
-        log_file << message << std::endl;
-        log_file.flush();
+    std::string summary = "Watching " + std::to_string(watched) + " directories";
+    if (crawler.dirs_excluded > 0) {
+        summary += ", skipped " + std::to_string(crawler.dirs_excluded) + " excluded";
     }
+    if (max_user_watches > 0) {
+        summary += " (limit " + std::to_string(max_user_watches) + ")";
+    }
+    log_message(summary);
 
-    if (!use_curses) {
-        std::cout << message << std::endl;
+    if (crawler.collect_from == 0) {
+        tree_snapshot.swap(crawler.entries);
+    } else if (snapshot_depth() >= 0) {
+        rescan_tree(root, 0, false);
     }
 }
 
-std::string get_current_time() {
-    auto now = std::chrono::system_clock::now();
-    auto time_t_now = std::chrono::system_clock::to_time_t(now);
-
-    char buffer[80];
-    struct tm* timeinfo = localtime(&time_t_now);
-    strftime(buffer, sizeof(buffer), "[%Y-%m-%d %H:%M:%S]", timeinfo);
-
-    return std::string(buffer);
+// Adds crawl results to the watch table. The first directory is the crawl
+// root and hangs below root_parent (-1 for the monitored root). The rest
+// are linked to their parents, which the crawl always lists first.
+void register_watches(const std::vector<CrawlDir>& dirs, int root_parent) {
+    std::unordered_map<std::string, int> by_path;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        const CrawlDir& dir = dirs[i];
+        if (dir.wd < 0) {
+            continue;
+        }
+        size_t slash = dir.path.rfind('/');
+        int parent = -1;
+        if (i == 0) {
+            parent = root_parent;
+        } else if (slash != std::string::npos) {
+            auto found = by_path.find(dir.path.substr(0, slash));
+            if (found != by_path.end()) {
+                parent = found->second;
+            }
+        }
+        if (parent >= 0 && slash != std::string::npos) {
+            set_watch(dir.wd, parent, dir.path.substr(slash + 1), dir.depth);
+        } else {
+            set_watch(dir.wd, -1, dir.path, dir.depth);
+        }
+        by_path.emplace(dir.path, dir.wd);
+    }
 }
 
-void print_usage() {
-    std::cout << "Usage: dirmon [OPTIONS] DIRECTORY" << std::endl;
-    std::cout << "Monitor a directory and log all changes (add, remove, edit) in real-time." << std::endl;
-    std::cout << std::endl;
-    std::cout << "Options:" << std::endl;
-    std::cout << "  -l, --log-file=FILE    Log events to FILE" << std::endl;
-    std::cout << "  -c, --curses           Use curses UI with live file change feed" << std::endl;
-    std::cout << "  -h, --help             Display this help and exit" << std::endl;
+void set_watch(int wd, int parent, const std::string& name, int depth) {
+    WatchEntry& entry = watches[wd];
+    if (entry.parent >= 0) {
+        watch_children.erase(EntryKey{entry.parent, entry.name});
+    }
+    entry.parent = parent;
+    entry.name = name;
+    entry.depth = depth;
+    entry.removed = false;
+    entry.path_generation = 0;
+    if (parent >= 0) {
+        watch_children[EntryKey{parent, name}] = wd;
+    }
 }
 
-void setup_curses() {
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-    start_color();
-    init_pair(1, COLOR_GREEN, COLOR_BLACK);
-    init_pair(2, COLOR_RED, COLOR_BLACK);
-    init_pair(3, COLOR_YELLOW, COLOR_BLACK);
-    init_pair(4, COLOR_BLUE, COLOR_BLACK);
-    init_pair(5, COLOR_CYAN, COLOR_BLACK);
-    refresh();
+// Marks a watch as gone. It stays resolvable until the end of the current
+// batch so that the events that announced its removal can still be named.
+void remove_watch(int wd) {
+    auto entry = watches.find(wd);
+    if (entry != watches.end() && !entry->second.removed) {
+        entry->second.removed = true;
+        removed_watches.push_back(wd);
+    }
 }
 
-void cleanup_curses() {
-    endwin();
+// Drops the watches removed in the last batch. History records and held
+// MODIFY events that refer to them switch to full paths first.
+void retire_removed_watches() {
+    if (removed_watches.empty()) {
+        return;
+    }
+
+    for (auto it = pending_modifies.begin(); it != pending_modifies.end();) {
+        auto entry = watches.find(it->first.wd);
+        if (entry != watches.end() && entry->second.removed) {
+            log_event(EVENT_MODIFIED, it->second.is_dir, it->first.wd, it->first.name.c_str(), it->second.first_seen, it->second.count);
+            it = pending_modifies.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (size_t i = 0; i < log_history.size(); ++i) {
+        EventRecord& record = log_history[i];
+        if (record.wd < 0 || record.type == EVENT_MESSAGE) {
+            continue;
+        }
+        auto entry = watches.find(record.wd);
+        if (entry == watches.end() || entry->second.removed) {
+            record.name = watch_path(record.wd) + "/" + record.name;
+            record.wd = -1;
+        }
+    }
+
+    for (int wd : removed_watches) {
+        auto entry = watches.find(wd);
+        if (entry != watches.end() && entry->second.removed) {
+            if (entry->second.parent >= 0) {
+                auto child = watch_children.find(EntryKey{entry->second.parent, entry->second.name});
+                if (child != watch_children.end() && child->second == wd) {
+                    watch_children.erase(child);
+                }
+            }
+            watches.erase(entry);
+        }
+    }
+    removed_watches.clear();
 }
 
-void update_curses_display() {
-    clear();
+// Crawls the tree again, logs how it differs from tree_snapshot in
+// directories at least min_depth deep, and makes the crawl the new
+// snapshot. Degraded mode uses this for the levels it does not watch.
+void rescan_tree(const std::string& root, int min_depth, bool emit_events) {
+    Crawler crawler;
+    crawler.collect_from = snapshot_depth();
+    crawler.jobs = crawl_jobs;
+    crawler.run(root, 0, false);
 
-    int max_y, max_x;
-    getmaxyx(stdscr, max_y, max_x);
+    if (emit_events) {
+        std::vector<std::pair<std::string, EventRecord>> changes;
+        for (const auto& dir : crawler.entries) {
+            if (dir.second.depth < min_depth) {
+                continue;
+            }
+            auto previous = tree_snapshot.find(dir.first);
+            for (const auto& entry : dir.second.entries) {
+                const SnapshotEntry* known = nullptr;
+                if (previous != tree_snapshot.end()) {
+                    auto found = previous->second.entries.find(entry.first);
+                    if (found != previous->second.entries.end()) {
+                        known = &found->second;
+                    }
+                }
+                if (!known) {
+                    add_change(changes, EVENT_CREATED, dir.first + "/" + entry.first, entry.second.is_dir);
+                } else if (snapshot_changed(*known, entry.second)) {
+                    add_change(changes, EVENT_MODIFIED, dir.first + "/" + entry.first, false);
+                }
+            }
+        }
+        for (const auto& dir : tree_snapshot) {
+            if (dir.second.depth < min_depth) {
+                continue;
+            }
+            auto current = crawler.entries.find(dir.first);
+            for (const auto& entry : dir.second.entries) {
+                if (current == crawler.entries.end() || !current->second.entries.count(entry.first)) {
+                    add_change(changes, EVENT_DELETED, dir.first + "/" + entry.first, entry.second.is_dir);
+                }
+            }
+        }
+        log_changes(changes);
+    }
 
-    attron(A_BOLD);
-    mvprintw(0, 0, "Directory Monitor - Press Ctrl+C to exit");
-    attroff(A_BOLD);
+    tree_snapshot.swap(crawler.entries);
+    next_rescan = std::chrono::steady_clock::now() + std::chrono::seconds(rescan_interval);
+}
 
-    mvhline(1, 0, ACS_HLINE, max_x);
+// Repairs tree_snapshot after lost events without crawling the tree.
+// Creating, removing or renaming an entry changes the mtime of its
+// directory, so only directories whose mtime differs from when they were
+// listed, and those never listed, are read again. New subdirectories are
+// crawled and watched. A file modified in place is only noticed if its
+// directory is read again for another reason.
+void rescan_changed_directories(const std::string& root) {
+    std::vector<std::pair<std::string, struct timespec>> stale;
+    for (const auto& dir : tree_snapshot) {
+        struct stat st;
+        // A directory that is gone is reported by its parent, which changed too.
+        if (lstat(dir.first.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        if (!dir.second.listed || st.st_mtim.tv_sec != dir.second.mtime.tv_sec ||
+            st.st_mtim.tv_nsec != dir.second.mtime.tv_nsec) {
+            stale.emplace_back(dir.first, st.st_mtim);
+        }
+    }
 
-    int display_lines = max_y - 3;
-    size_t start_idx = (log_history.size() > static_cast<size_t>(display_lines)) ? 
-                      log_history.size() - static_cast<size_t>(display_lines) : 0;
-    
-    for (size_t i = start_idx, line = 2; i < log_history.size() && line < static_cast<size_t>(max_y - 1); ++i, ++line) {
-        const std::string& entry = log_history[i];
-        
-        if (entry.find("CREATED") != std::string::npos) {
-            attron(COLOR_PAIR(1));
-        } else if (entry.find("DELETED") != std::string::npos) {
-            attron(COLOR_PAIR(2));
-        } else if (entry.find("MODIFIED") != std::string::npos) {
-            attron(COLOR_PAIR(3));
-        } else if (entry.find("MOVED") != std::string::npos) {
-            attron(COLOR_PAIR(4));
-        } else if (entry.find("ATTRIBUTES") != std::string::npos) {
-            attron(COLOR_PAIR(5));
+    std::vector<std::pair<std::string, EventRecord>> changes;
+    std::vector<std::pair<std::string, int>> created_dirs;
+    for (const auto& changed : stale) {
+        const std::string& path = changed.first;
+        auto dir = tree_snapshot.find(path);
+        if (dir == tree_snapshot.end()) {
+            continue;
         }
-        
-        if (entry.length() > static_cast<size_t>(max_x)) {
-            mvprintw(line, 0, "%s", entry.substr(0, max_x - 3).c_str());
-            mvprintw(line, max_x - 3, "...");
-        } else {
-            mvprintw(line, 0, "%s", entry.c_str());
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR* listing = fd >= 0 ? fdopendir(fd) : nullptr;
+        if (!listing) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
         }
-        
-        attroff(COLOR_PAIR(1) | COLOR_PAIR(2) | COLOR_PAIR(3) | COLOR_PAIR(4) | COLOR_PAIR(5));
+        std::unordered_map<std::string, SnapshotEntry> current;
+        struct dirent* entry;
+        while ((entry = readdir(listing)) != nullptr) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            bool is_dir = S_ISDIR(st.st_mode);
+            if (!path_filter.rules.empty() && path_filter.excluded_path((path + "/" + entry->d_name).c_str(), is_dir)) {
+                continue;
+            }
+            current.emplace(entry->d_name, SnapshotEntry{st.st_mtim, st.st_size, st.st_ino, is_dir, false});
+        }
+        closedir(listing);
+
+        SnapshotDir& known = dir->second;
+        for (const auto& previous : known.entries) {
+            auto found = current.find(previous.first);
+            if (found != current.end() && found->second.is_dir == previous.second.is_dir) {
+                continue;
+            }
+            std::string child = path + "/" + previous.first;
+            add_change(changes, EVENT_DELETED, child, previous.second.is_dir);
+            if (previous.second.is_dir) {
+                // Everything below was removed or moved along with it.
+                std::vector<Snapshot::const_iterator> below;
+                auto own = tree_snapshot.find(child);
+                if (own != tree_snapshot.end()) {
+                    below.push_back(own);
+                }
+                auto last = tree_snapshot.lower_bound(child + "0");
+                for (auto it = tree_snapshot.lower_bound(child + "/"); it != last; ++it) {
+                    below.push_back(it);
+                }
+                for (auto removed : below) {
+                    for (const auto& gone : removed->second.entries) {
+                        add_change(changes, EVENT_DELETED, removed->first + "/" + gone.first, gone.second.is_dir);
+                    }
+                }
+                erase_snapshot_subtree(child);
+            }
+        }
+        for (const auto& found : current) {
+            auto previous = known.entries.find(found.first);
+            std::string child = path + "/" + found.first;
+            if (previous == known.entries.end() || previous->second.is_dir != found.second.is_dir) {
+                add_change(changes, EVENT_CREATED, child, found.second.is_dir);
+                if (found.second.is_dir) {
+                    created_dirs.emplace_back(child, known.depth + 1);
+                }
+            } else if (snapshot_changed(previous->second, found.second)) {
+                add_change(changes, EVENT_MODIFIED, child, false);
+            }
+        }
+        known.entries.swap(current);
+        known.mtime = changed.second;
+        known.listed = true;
+    }
+
+    int root_wd = created_dirs.empty() ? -1 : root_watch(root);
+    for (const auto& created : created_dirs) {
+        const std::string& path = created.first;
+        Crawler crawler;
+        crawler.collect_from = created.second;
+        crawler.jobs = crawl_jobs;
+        try {
+            crawler.run(path, created.second, false);
+        } catch (const std::exception& e) {
+            log_message(std::string("Warning: ") + e.what());
+            continue;
+        }
+        erase_snapshot_subtree(path);
+        for (auto& dir : crawler.entries) {
+            for (const auto& entry : dir.second.entries) {
+                add_change(changes, EVENT_CREATED, dir.first + "/" + entry.first, entry.second.is_dir);
+            }
+            tree_snapshot[dir.first] = std::move(dir.second);
+        }
+        event_source->directory_created(find_watch(root_wd, root, path.substr(0, path.rfind('/'))), path);
+    }
+    if (!created_dirs.empty()) {
+        path_generation++;
+    }
+
+    log_changes(changes);
+}
+
+void add_change(std::vector<std::pair<std::string, EventRecord>>& changes, EventType type, std::string path, bool is_dir) {
+    changes.emplace_back(std::move(path), EventRecord());
+    changes.back().second.type = type;
+    changes.back().second.is_dir = is_dir;
+}
+
+// Whether a file's metadata differs from what the snapshot recorded. Dirty
+// entries have nothing to compare against.
+bool snapshot_changed(const SnapshotEntry& known, const SnapshotEntry& current) {
+    return !current.is_dir && !known.dirty &&
+           (known.size != current.size || known.inode != current.inode ||
+            known.mtime.tv_sec != current.mtime.tv_sec || known.mtime.tv_nsec != current.mtime.tv_nsec);
+}
+
+// Logs the changes sorted by path, so that a directory's own event
+// precedes its contents.
+void log_changes(std::vector<std::pair<std::string, EventRecord>>& changes) {
+    std::sort(changes.begin(), changes.end(), [](const std::pair<std::string, EventRecord>& a,
+                                                 const std::pair<std::string, EventRecord>& b) {
+        return a.first < b.first;
+    });
+    EventTime now = event_clock();
+    for (const auto& change : changes) {
+        log_event(change.second.type, change.second.is_dir, -1, change.first.c_str(), now);
+    }
+}
+
+// The watch on the monitored root, or -1.
+int root_watch(const std::string& root) {
+    for (const auto& entry : watches) {
+        if (entry.second.parent < 0 && !entry.second.removed && entry.second.name == root) {
+            return entry.first;
+        }
+    }
+    return -1;
+}
+
+// The watch on a directory below root, whose watch is wd, found through
+// watch_children one path component at a time, or -1 if it is not watched.
+int find_watch(int wd, const std::string& root, const std::string& path) {
+    if (wd < 0 || path.compare(0, root.size(), root) != 0) {
+        return -1;
+    }
+    size_t start = root.size();
+    while (start < path.size()) {
+        if (path[start] != '/') {
+            return -1;
+        }
+        size_t end = path.find('/', start + 1);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        auto child = watch_children.find(EntryKey{wd, path.substr(start + 1, end - start - 1)});
+        if (child == watch_children.end()) {
+            return -1;
+        }
+        wd = child->second;
+        start = end;
+    }
+    return wd;
+}
+
+// Depth from which tree_snapshot holds entries: 0 for the whole tree
+// with --snapshot, the first unwatched level for degraded mode without
+// it, or -1 for no snapshot at all.
+int snapshot_depth() {
+    if (keep_snapshot) {
+        return 0;
+    }
+    return watch_levels > 0 ? watch_levels : -1;
+}
+
+// Applies an event to the snapshot without calling stat(). Renames and
+// moves out are applied when they are paired or time out. A directory
+// that appears gets an empty listing that is not marked as listed.
+void update_snapshot(const SourceEvent& event, bool is_dir) {
+    if (event.mask & (IN_MOVED_FROM | IN_IGNORED | IN_DELETE_SELF)) {
+        return;
+    }
+    std::string path = entry_path(event.dir, event.name);
+    if (event.mask & IN_DELETE) {
+        snapshot_remove(path, is_dir);
+        return;
+    }
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        return;
+    }
+    auto parent = tree_snapshot.try_emplace(path.substr(0, slash));
+    if (parent.second) {
+        auto dir = watches.find(event.dir);
+        parent.first->second.depth = dir != watches.end() ? dir->second.depth : 0;
+    }
+    SnapshotEntry& entry = parent.first->second.entries[path.substr(slash + 1)];
+    entry.is_dir = is_dir;
+    entry.dirty = true;
+    if (is_dir && (event.mask & (IN_CREATE | IN_MOVED_TO))) {
+        auto created = tree_snapshot.try_emplace(path);
+        if (created.second) {
+            created.first->second.depth = parent.first->second.depth + 1;
+        }
+    }
+}
+
+// Drops the listings of path and of every directory below it. Those all
+// start with path + "/" and so form one range; '0' sorts right after '/'.
+void erase_snapshot_subtree(const std::string& path) {
+    tree_snapshot.erase(path);
+    tree_snapshot.erase(tree_snapshot.lower_bound(path + "/"), tree_snapshot.lower_bound(path + "0"));
+}
+
+// Moves an entry to its new parent, and for a directory re-keys the
+// listings below it.
+void snapshot_move(const std::string& from, const std::string& to, bool is_dir) {
+    size_t from_slash = from.rfind('/');
+    size_t to_slash = to.rfind('/');
+    if (from_slash == std::string::npos || to_slash == std::string::npos) {
+        return;
+    }
+    auto from_parent = tree_snapshot.find(from.substr(0, from_slash));
+    auto to_parent = tree_snapshot.find(to.substr(0, to_slash));
+    if (from_parent != tree_snapshot.end()) {
+        auto entry = from_parent->second.entries.find(from.substr(from_slash + 1));
+        if (entry != from_parent->second.entries.end()) {
+            SnapshotEntry moved = entry->second;
+            from_parent->second.entries.erase(entry);
+            if (to_parent != tree_snapshot.end()) {
+                to_parent->second.entries[to.substr(to_slash + 1)] = moved;
+            }
+        }
+    }
+    if (!is_dir) {
+        return;
+    }
+
+    std::vector<Snapshot::node_type> moved;
+    auto own = tree_snapshot.find(from);
+    if (own != tree_snapshot.end()) {
+        moved.push_back(tree_snapshot.extract(own));
+    }
+    auto last = tree_snapshot.lower_bound(from + "0");
+    for (auto it = tree_snapshot.lower_bound(from + "/"); it != last;) {
+        moved.push_back(tree_snapshot.extract(it++));
+    }
+    if (moved.empty()) {
+        return;
+    }
+    erase_snapshot_subtree(to);
+    int depth_change = static_cast<int>(std::count(to.begin(), to.end(), '/') - std::count(from.begin(), from.end(), '/'));
+    for (Snapshot::node_type& node : moved) {
+        node.key() = to + node.key().substr(from.size());
+        node.mapped().depth += depth_change;
+        tree_snapshot.insert(std::move(node));
+    }
+}
+
+// Removes an entry, and for a directory every listing below it.
+void snapshot_remove(const std::string& path, bool is_dir) {
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos) {
+        auto parent = tree_snapshot.find(path.substr(0, slash));
+        if (parent != tree_snapshot.end()) {
+            parent->second.entries.erase(path.substr(slash + 1));
+        }
+    }
+    if (is_dir) {
+        erase_snapshot_subtree(path);
+    }
+}
+
+// The kernel dropped events. Recovery runs once the current batch is done.
+void queue_overflowed() {
+    overflow_count++;
+    overflow_pending = true;
+}
+
+long read_max_user_watches() {
+    FILE* file = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+    if (!file) {
+        return -1;
+    }
+    long limit = -1;
+    if (fscanf(file, "%ld", &limit) != 1) {
+        limit = -1;
+    }
+    fclose(file);
+    return limit;
+}
+
+void report_crawl_progress(size_t dirs, size_t watched, bool done) {
+    char line[128];
+    snprintf(line, sizeof(line), "Scanning: %zu directories, %zu watches", dirs, watched);
+    if (use_curses) {
+        mvprintw(0, 0, "%s", line);
+        clrtoeol();
+        refresh();
+    } else if (isatty(STDERR_FILENO)) {
+        std::cerr << "\r" << line << (done ? "\n" : "") << std::flush;
+    }
+}
+
+void Crawler::run(const std::string& root, int root_depth, bool report_progress) {
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open directory: " + root);
+    }
+    open_fds = 1;
+    queue.push_back(CrawlItem{root, root_depth, fd});
+
+    if (jobs <= 1) {
+        work();
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < jobs; ++i) {
+        threads.push_back(start_thread(&Crawler::work, this));
+    }
+    if (report_progress) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!queue.empty() || active > 0) {
+            wake.wait_for(lock, std::chrono::milliseconds(250));
+            report_crawl_progress(dirs_scanned, watches_added, false);
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (report_progress) {
+        report_crawl_progress(dirs_scanned, watches_added, true);
+    }
+
+    // Sorting by depth and path makes the result independent of thread
+    // timing and puts the root first.
+    std::sort(dirs.begin(), dirs.end(), [](const CrawlDir& a, const CrawlDir& b) {
+        return a.depth != b.depth ? a.depth < b.depth : a.path < b.path;
+    });
+}
+
+void Crawler::work() {
+    std::vector<CrawlItem> children;
+    std::vector<CrawlDir> found;
+    std::vector<std::pair<std::string, SnapshotDir>> collected;
+    std::vector<std::string> errors;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return !queue.empty() || active == 0; });
+        if (queue.empty()) {
+            break;
+        }
+        CrawlItem item = std::move(queue.back());
+        queue.pop_back();
+        active++;
+        lock.unlock();
+
+        children.clear();
+        scan(item, children, found, collected, errors);
+
+        lock.lock();
+        active--;
+        for (CrawlItem& child : children) {
+            queue.push_back(std::move(child));
+        }
+        if (!children.empty() || (queue.empty() && active == 0)) {
+            wake.notify_all();
+        }
+    }
+
+    dirs.insert(dirs.end(), found.begin(), found.end());
+    for (auto& dir : collected) {
+        entries.emplace(std::move(dir.first), std::move(dir.second));
+    }
+    warnings.insert(warnings.end(), errors.begin(), errors.end());
+    lock.unlock();
+    wake.notify_all();
+}
+
+void Crawler::scan(const CrawlItem& item, std::vector<CrawlItem>& children, std::vector<CrawlDir>& found,
+                   std::vector<std::pair<std::string, SnapshotDir>>& collected, std::vector<std::string>& errors) {
+    int fd = item.fd;
+    if (fd < 0) {
+        fd = open(item.path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            errors.push_back("Could not open directory: " + item.path);
+            return;
+        }
+    } else {
+        open_fds--;
+    }
+
+    int wd = -1;
+    bool watched = inotify_fd >= 0 && (watch_levels == 0 || item.depth < watch_levels);
+    if (watched && !limit_reached) {
+        wd = inotify_add_watch(inotify_fd, item.path.c_str(), WATCH_MASK);
+        if (wd >= 0) {
+            watches_added++;
+        } else if (errno == ENOSPC) {
+            limit_reached = true;
+        } else {
+            errors.push_back("Could not add watch for: " + item.path);
+        }
+    }
+    found.push_back(CrawlDir{item.path, item.depth, wd});
+    dirs_scanned++;
+
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        errors.push_back("Could not open directory: " + item.path);
+        return;
+    }
+
+    bool descend = descend_all || watch_levels == 0 || item.depth + 1 < watch_levels;
+    bool collect = collect_from >= 0 && item.depth >= collect_from;
+    SnapshotDir listing;
+    struct stat dir_st;
+    if (collect && fstat(fd, &dir_st) == 0) {
+        listing.mtime = dir_st.st_mtim;
+        listing.depth = item.depth;
+        listing.listed = true;
+    } else {
+        collect = false;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        bool is_dir = entry->d_type == DT_DIR;
+        struct stat st;
+        bool have_stat = false;
+        if (entry->d_type == DT_UNKNOWN || collect) {
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+            have_stat = true;
+        }
+
+        std::string child_path = item.path + "/" + entry->d_name;
+        if (!path_filter.rules.empty() && path_filter.excluded_path(child_path.c_str(), is_dir)) {
+            if (is_dir) {
+                dirs_excluded++;
+            }
+            continue;
+        }
+        if (collect && have_stat) {
+            listing.entries.emplace(entry->d_name, SnapshotEntry{st.st_mtim, st.st_size, st.st_ino, is_dir, false});
+        }
+        if (!is_dir || !descend) {
+            continue;
+        }
+
+        int child_fd = -1;
+        if (open_fds < CRAWL_MAX_OPEN_FDS) {
+            child_fd = openat(fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd >= 0) {
+                open_fds++;
+            }
+        }
+        children.push_back(CrawlItem{std::move(child_path), item.depth + 1, child_fd});
+    }
+
+    closedir(dir);
+    if (collect) {
+        collected.emplace_back(item.path, std::move(listing));
+    }
+}
+
+// Uses fanotify unless --backend=inotify. It falls back to inotify when
+// fanotify is unavailable, typically for lack of CAP_SYS_ADMIN, on
+// kernels older than 5.9, or on filesystems without file handle support.
+std::unique_ptr<EventSource> open_event_source(const std::string& root) {
+    if (backend != "inotify") {
+        std::unique_ptr<EventSource> fanotify(new FanotifySource());
+        try {
+            fanotify->start(root);
+            return fanotify;
+        } catch (const std::exception& e) {
+            if (backend == "fanotify") {
+                log_message(std::string("Warning: ") + e.what() + "; falling back to inotify");
+            }
+        }
+    }
+
+    std::unique_ptr<EventSource> inotify(new InotifySource());
+    inotify->start(root);
+    return inotify;
+}
+
+InotifySource::~InotifySource() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void InotifySource::start(const std::string& root) {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not initialize inotify");
+    }
+    watch_initial_tree(fd, root);
+}
+
+bool InotifySource::read_events(EventTime batch_time) {
+    while (true) {
+        ssize_t length = read(fd, event_buffer, BUF_LEN);
+        if (length < 0) {
+            if (errno == EAGAIN) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message("Error: Could not read inotify events");
+            return false;
+        }
+
+        ssize_t i = 0;
+        uint64_t batch = 0;
+        while (i < length) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(&event_buffer[i]);
+            i += sizeof(struct inotify_event) + event->len;
+            batch++;
+
+            if (event->len) {
+                handle_event(SourceEvent{event->mask, event->cookie, event->wd, event->name}, batch_time);
+            } else if (event->mask & IN_Q_OVERFLOW) {
+                queue_overflowed();
+            } else if (event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                remove_watch(event->wd);
+            }
+        }
+        metrics.batch_sizes.record(batch);
+    }
+}
+
+void InotifySource::directory_created(int parent, const std::string& path) {
+    auto entry = watches.find(parent);
+    int depth = entry != watches.end() ? entry->second.depth + 1 : 0;
+    if (watch_levels == 0 || depth < watch_levels) {
+        try {
+            add_watch_recursive(fd, parent, path, depth);
+        } catch (const std::exception& e) {
+            log_message(std::string("Error adding watch: ") + e.what());
+        }
+    }
+}
+
+// The moved directory keeps its watch descriptor and so does its whole
+// subtree; relinking the one entry renames all of them.
+void InotifySource::directory_renamed(int from_dir, const std::string& from_name, int to_dir, const std::string& to_name) {
+    auto child = watch_children.find(EntryKey{from_dir, from_name});
+    if (child == watch_children.end()) {
+        directory_created(to_dir, watch_path(to_dir) + "/" + to_name);
+        return;
+    }
+    int wd = child->second;
+    auto parent = watches.find(to_dir);
+    set_watch(wd, to_dir, to_name, parent != watches.end() ? parent->second.depth + 1 : 0);
+    path_generation++;
+}
+
+// Stops watching a directory that was moved out of the monitored tree,
+// together with everything below it.
+void InotifySource::directory_moved_out(int dir, const std::string& name) {
+    auto child = watch_children.find(EntryKey{dir, name});
+    if (child == watch_children.end()) {
+        return;
+    }
+    int top = child->second;
+
+    std::unordered_map<int, bool> inside;
+    inside[top] = true;
+    std::vector<int> chain;
+    for (const auto& entry : watches) {
+        chain.clear();
+        int wd = entry.first;
+        bool below = false;
+        while (wd >= 0) {
+            auto known = inside.find(wd);
+            if (known != inside.end()) {
+                below = known->second;
+                break;
+            }
+            chain.push_back(wd);
+            auto parent = watches.find(wd);
+            wd = parent != watches.end() ? parent->second.parent : -1;
+        }
+        for (int visited : chain) {
+            inside[visited] = below;
+        }
+    }
+    for (const auto& entry : inside) {
+        if (entry.second) {
+            inotify_rm_watch(fd, entry.first);
+            remove_watch(entry.first);
+        }
+    }
+}
+
+FanotifySource::~FanotifySource() {
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (mount_fd >= 0) {
+        close(mount_fd);
+    }
+}
+
+void FanotifySource::start(const std::string& path) {
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Could not initialize fanotify: ") + strerror(errno));
+    }
+    // FAN_RENAME (Linux 5.17) reports both names of a rename in one event;
+    // older kernels get separate MOVED_FROM/MOVED_TO events.
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK | FAN_RENAME, AT_FDCWD, path.c_str()) != 0 &&
+        fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK | FAN_MOVED_FROM | FAN_MOVED_TO, AT_FDCWD, path.c_str()) != 0) {
+        throw std::runtime_error("Could not add fanotify mark for " + path + ": " + strerror(errno));
+    }
+    mount_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char* resolved = realpath(path.c_str(), nullptr);
+    if (mount_fd < 0 || !resolved) {
+        free(resolved);
+        throw std::runtime_error("Could not open directory: " + path);
+    }
+
+    // Both forms without a trailing slash, so "/" becomes "".
+    real_root = resolved;
+    free(resolved);
+    root = path;
+    while (!real_root.empty() && real_root.back() == '/') {
+        real_root.pop_back();
+    }
+    while (!root.empty() && root.back() == '/') {
+        root.pop_back();
+    }
+    log_message("Watching the whole filesystem with one fanotify mark");
+
+    // A fanotify mark needs no crawl; only --snapshot walks the tree.
+    if (keep_snapshot) {
+        rescan_tree(path, 0, false);
+    }
+}
+
+bool FanotifySource::read_events(EventTime batch_time) {
+    while (true) {
+        ssize_t length = read(fd, event_buffer, BUF_LEN);
+        if (length < 0) {
+            if (errno == EAGAIN) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message("Error: Could not read fanotify events");
+            return false;
+        }
+
+        const struct fanotify_event_metadata* metadata = reinterpret_cast<const struct fanotify_event_metadata*>(event_buffer);
+        uint64_t batch = 0;
+        for (; FAN_EVENT_OK(metadata, length); metadata = FAN_EVENT_NEXT(metadata, length)) {
+            batch++;
+            if (metadata->vers != FANOTIFY_METADATA_VERSION) {
+                log_message("Error: Unsupported fanotify metadata version");
+                return false;
+            }
+            if (metadata->fd >= 0) {
+                close(metadata->fd);
+            }
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                queue_overflowed();
+                continue;
+            }
+
+            // The first info record names the affected entry; a rename adds
+            // one for the old and one for the new name.
+            const struct fanotify_event_info_fid* target = nullptr;
+            const struct fanotify_event_info_fid* old_target = nullptr;
+            const char* info = reinterpret_cast<const char*>(metadata + 1);
+            const char* info_end = reinterpret_cast<const char*>(metadata) + metadata->event_len;
+            while (info + sizeof(struct fanotify_event_info_fid) <= info_end) {
+                const struct fanotify_event_info_fid* record = reinterpret_cast<const struct fanotify_event_info_fid*>(info);
+                if (record->hdr.len == 0) {
+                    break;
+                }
+                if (record->hdr.info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME) {
+                    old_target = record;
+                } else if (!target && (record->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+                                       record->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID ||
+                                       record->hdr.info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)) {
+                    target = record;
+                }
+                info += record->hdr.len;
+            }
+            if (!target && !old_target) {
+                continue;
+            }
+
+            uint32_t mask = static_cast<uint32_t>(metadata->mask);
+            uint32_t ondir = mask & FAN_ONDIR;
+            if (ondir && (mask & (FAN_RENAME | FAN_MOVED_TO))) {
+                forget_outside_directories();
+            }
+            if (mask & FAN_RENAME) {
+                uint32_t cookie = next_cookie++;
+                if (next_cookie == 0) {
+                    next_cookie = 1;
+                }
+                if (old_target) {
+                    emit(old_target, IN_MOVED_FROM | ondir, cookie, batch_time);
+                }
+                if (target) {
+                    emit(target, IN_MOVED_TO | ondir, cookie, batch_time);
+                }
+            }
+            if (!target) {
+                continue;
+            }
+
+            // Queued events on the same entry are merged into one mask, so
+            // split it again in the most likely order.
+            static const uint32_t order[] = {FAN_CREATE, FAN_MOVED_TO, FAN_MODIFY, FAN_ATTRIB, FAN_MOVED_FROM, FAN_DELETE};
+            for (uint32_t bit : order) {
+                if (mask & bit) {
+                    emit(target, bit | ondir, 0, batch_time);
+                }
+            }
+
+            // A deleted directory's handle never comes back; drop its id.
+            if (mask & FAN_DELETE_SELF) {
+                int dir = directory_id(target, false);
+                if (dir > 0) {
+                    remove_watch(dir);
+                }
+            }
+        }
+        metrics.batch_sizes.record(batch);
+    }
+}
+
+void FanotifySource::emit(const struct fanotify_event_info_fid* info, uint32_t mask, uint32_t cookie, EventTime batch_time) {
+    int dir = directory_id(info, true);
+    if (dir <= 0) {
+        return;
+    }
+
+    const struct file_handle* handle = reinterpret_cast<const struct file_handle*>(info->handle);
+    const char* name = ".";
+    if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) {
+        name = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+    }
+
+    // Events on a directory itself come as the directory's handle and ".".
+    // They are logged by full path, except for the root, which inotify
+    // does not report either.
+    std::string self_path;
+    if (strcmp(name, ".") == 0) {
+        if (watch_path(dir) == root) {
+            return;
+        }
+        self_path = watch_path(dir);
+        name = self_path.c_str();
+        dir = -1;
+    }
+
+    handle_event(SourceEvent{mask, cookie, dir, name}, batch_time);
+}
+
+// Returns the dir id for the directory in an event, 0 when it lies
+// outside the root or in an excluded subtree, or -1 when it is not known and resolve is false or
+// it cannot be resolved anymore (usually because it was deleted).
+int FanotifySource::directory_id(const struct fanotify_event_info_fid* info, bool resolve) {
+    const struct file_handle* handle = reinterpret_cast<const struct file_handle*>(info->handle);
+    std::string key(reinterpret_cast<const char*>(&info->fsid), sizeof(info->fsid));
+    key.append(reinterpret_cast<const char*>(handle), sizeof(*handle) + handle->handle_bytes);
+
+    auto cached = directory_ids.find(key);
+    if (cached != directory_ids.end()) {
+        return cached->second;
+    }
+    if (!resolve) {
+        return -1;
+    }
+
+    int dir_fd = open_by_handle_at(mount_fd, const_cast<struct file_handle*>(handle), O_PATH | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    char link[64];
+    char target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    ssize_t length = readlink(link, target, sizeof(target) - 1);
+    close(dir_fd);
+    if (length <= 0) {
+        return -1;
+    }
+    std::string path(target, length);
+    if (path.size() > 10 && path.compare(path.size() - 10, 10, " (deleted)") == 0) {
+        return -1;
+    }
+
+    int id = 0;
+    if (path == real_root || path.compare(0, real_root.size() + 1, real_root + "/") == 0) {
+        std::string logged = root + path.substr(std::min(path.size(), real_root.size()));
+        if (path_filter.rules.empty() || !path_filter.excluded_directory(logged.c_str())) {
+            id = next_id++;
+            set_watch(id, -1, logged, 0);
+        }
+    }
+    directory_ids.emplace(std::move(key), id);
+    return id;
+}
+
+// Called after a directory rename: every cached path below it is stale,
+// and there is no cheap way to tell which ones, so all ids are retired
+// and directories are resolved again on their next event.
+void FanotifySource::forget_directories() {
+    for (const auto& entry : directory_ids) {
+        if (entry.second > 0) {
+            remove_watch(entry.second);
+        }
+    }
+    directory_ids.clear();
+}
+
+// Called when a directory is moved anywhere on the filesystem: it, and
+// everything below it, may have been cached as outside the root and now
+// be inside, so those entries are resolved again on their next event.
+void FanotifySource::forget_outside_directories() {
+    for (auto it = directory_ids.begin(); it != directory_ids.end();) {
+        if (it->second == 0) {
+            it = directory_ids.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void handle_event(const SourceEvent& event, EventTime batch_time) {
+    bool is_dir = event.mask & IN_ISDIR;
+
+    // Anything but the matching MOVED_TO settles pending renames as moves
+    // out, which also drops the watches below a moved-out directory. Their
+    // remaining events happened outside the tree.
+    if (!pending_renames.empty() && !pairs_pending_rename(event)) {
+        flush_pending_renames();
+    }
+    auto watch = watches.find(event.dir);
+    if (watch != watches.end() && watch->second.removed) {
+        return;
+    }
+
+    if (!path_filter.rules.empty() && event_excluded(event, is_dir)) {
+        return;
+    }
+
+    if (snapshot_depth() == 0) {
+        update_snapshot(event, is_dir);
+    }
+
+    if (event.mask & IN_MODIFY) {
+        if (coalesce_ms > 0) {
+            EntryKey key{event.dir, event.name};
+            auto pending = pending_modifies.find(key);
+            if (pending != pending_modifies.end()) {
+                pending->second.count++;
+            } else {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(coalesce_ms);
+                pending_modifies.emplace(std::move(key), PendingModify{deadline, batch_time, is_dir, 1});
+            }
+            return;
+        }
+        log_event(EVENT_MODIFIED, is_dir, event.dir, event.name, batch_time);
+        return;
+    }
+
+    // Anything else on a path with a held-back MODIFY is logged after it.
+    if (!pending_modifies.empty()) {
+        flush_pending_modify(EntryKey{event.dir, event.name});
+    }
+
+    EventType type;
+    if (event.mask & IN_CREATE) {
+        type = EVENT_CREATED;
+
+        if (is_dir) {
+            event_source->directory_created(event.dir, entry_path(event.dir, event.name));
+        }
+    } else if (event.mask & IN_DELETE) {
+        type = EVENT_DELETED;
+    } else if (event.mask & IN_MOVED_FROM) {
+        if (event.cookie) {
+            pending_renames.push_back(PendingRename{event.cookie, event.dir, event.name,
+                                                    entry_path(event.dir, event.name), is_dir, batch_time});
+            return;
+        }
+        type = EVENT_MOVED_FROM;
+        if (snapshot_depth() == 0) {
+            snapshot_remove(entry_path(event.dir, event.name), is_dir);
+        }
+    } else if (event.mask & IN_MOVED_TO) {
+        for (auto it = pending_renames.begin(); event.cookie && it != pending_renames.end(); ++it) {
+            if (it->cookie == event.cookie) {
+                log_rename(*it, event.dir, event.name, batch_time);
+                if (snapshot_depth() == 0) {
+                    snapshot_move(it->path, entry_path(event.dir, event.name), is_dir);
+                }
+                if (is_dir) {
+                    event_source->directory_renamed(it->dir, it->name, event.dir, event.name);
+                }
+                pending_renames.erase(it);
+                return;
+            }
+        }
+        type = EVENT_MOVED_TO;
+
+        if (is_dir) {
+            event_source->directory_created(event.dir, entry_path(event.dir, event.name));
+        }
+    } else if (event.mask & IN_ATTRIB) {
+        type = EVENT_ATTRIBUTES_CHANGED;
+    } else {
+        type = EVENT_UNKNOWN;
+    }
+
+    log_event(type, is_dir, event.dir, event.name, batch_time, 1, event.cookie);
+}
+
+// Adds one rule. A trailing '/' limits it to directories, and a '/' at
+// the start or in the middle anchors it to the monitored root; other
+// rules match the entry name at any depth.
+void PathFilter::add(std::string pattern, bool include) {
+    FilterRule rule;
+    rule.include = include;
+    rule.dir_only = false;
+    while (pattern.size() > 1 && pattern.back() == '/') {
+        pattern.pop_back();
+        rule.dir_only = true;
+    }
+    rule.anchored = pattern.find('/') != std::string::npos;
+    if (!pattern.empty() && pattern[0] == '/') {
+        pattern.erase(0, 1);
+    }
+    if (pattern.empty()) {
+        return;
+    }
+
+    size_t special = pattern.find_first_of("*?[\\");
+    if (special == std::string::npos) {
+        rule.match = FILTER_LITERAL;
+        rule.literal = pattern;
+    } else if (!rule.anchored && special == 0 && pattern.find_first_of("*?[\\", 1) == std::string::npos) {
+        rule.match = FILTER_SUFFIX;
+        rule.literal = pattern.substr(1);
+    } else if (!rule.anchored && special == pattern.size() - 1 && pattern.back() == '*') {
+        rule.match = FILTER_PREFIX;
+        rule.literal = pattern.substr(0, special);
+    } else {
+        rule.match = FILTER_GLOB;
+    }
+    rule.pattern = std::move(pattern);
+    anchored = anchored || rule.anchored;
+    rules.push_back(std::move(rule));
+}
+
+// Reads gitignore-style rules: blank lines and lines starting with '#'
+// are skipped, '!' turns a rule into an include, and a leading backslash
+// escapes either.
+bool PathFilter::load(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        return false;
+    }
+    char buffer[PATH_MAX + 2];
+    while (fgets(buffer, sizeof(buffer), file)) {
+        std::string line = buffer;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+            line.pop_back();
+        }
+        while (!line.empty() && line.back() == ' ' && (line.size() < 2 || line[line.size() - 2] != '\\')) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        bool include = line[0] == '!';
+        if (include) {
+            line.erase(0, 1);
+        } else if (line[0] == '\\' && line.size() > 1 && (line[1] == '#' || line[1] == '!')) {
+            line.erase(0, 1);
+        }
+        add(line, include);
+    }
+    fclose(file);
+    return true;
+}
+
+// relative is the entry's path below the monitored root and name points
+// at its last component. The last matching rule decides.
+bool PathFilter::excluded(const char* relative, const char* name, bool is_dir) const {
+    if (*relative == '\0') {
+        return false;
+    }
+    size_t name_length = 0;
+    for (auto rule = rules.rbegin(); rule != rules.rend(); ++rule) {
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+        const char* text = rule->anchored ? relative : name;
+        bool matched;
+        switch (rule->match) {
+            case FILTER_LITERAL:
+                matched = rule->literal == text;
+                break;
+            case FILTER_SUFFIX:
+                if (name_length == 0) {
+                    name_length = strlen(name);
+                }
+                matched = name_length >= rule->literal.size() &&
+                          memcmp(name + name_length - rule->literal.size(), rule->literal.data(), rule->literal.size()) == 0;
+                break;
+            case FILTER_PREFIX:
+                matched = strncmp(name, rule->literal.data(), rule->literal.size()) == 0;
+                break;
+            default:
+                matched = glob_match(rule->pattern.c_str(), text);
+                break;
+        }
+        if (matched) {
+            return !rule->include;
+        }
+    }
+    return false;
+}
+
+bool PathFilter::excluded_path(const char* path, bool is_dir) const {
+    const char* relative = relative_path(path);
+    const char* slash = strrchr(relative, '/');
+    return excluded(relative, slash ? slash + 1 : relative, is_dir);
+}
+
+// True if the directory at path or any directory between it and the root
+// is excluded. Nothing below an excluded directory can be included again.
+bool PathFilter::excluded_directory(const char* path) const {
+    const char* relative = relative_path(path);
+    std::string prefix;
+    for (const char* component = relative; *component != '\0';) {
+        const char* end = strchr(component, '/');
+        if (!end) {
+            end = component + strlen(component);
+        }
+        prefix.assign(relative, end - relative);
+        if (excluded(prefix.c_str(), prefix.c_str() + (component - relative), true)) {
+            return true;
+        }
+        component = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+// Matches a glob against text. '*', '?' and bracket expressions stop at
+// '/', "**" crosses it, and "**/" also matches no directory at all.
+bool glob_match(const char* pattern, const char* text) {
+    while (*pattern) {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            pattern += 2;
+            bool slash = *pattern == '/';
+            if (slash) {
+                pattern++;
+            }
+            for (const char* rest = text;; rest++) {
+                if ((!slash || rest == text || rest[-1] == '/') && glob_match(pattern, rest)) {
+                    return true;
+                }
+                if (*rest == '\0') {
+                    return false;
+                }
+            }
+        }
+        if (*pattern == '*') {
+            pattern++;
+            for (const char* rest = text;; rest++) {
+                if (glob_match(pattern, rest)) {
+                    return true;
+                }
+                if (*rest == '\0' || *rest == '/') {
+                    return false;
+                }
+            }
+        }
+        if (*text == '\0') {
+            return false;
+        }
+        if ((*pattern == '?' || *pattern == '[') && *text == '/') {
+            return false;
+        }
+        if (*pattern == '?') {
+            pattern++;
+            text++;
+            continue;
+        }
+        if (*pattern == '[') {
+            const char* p = pattern + 1;
+            bool negate = *p == '!' || *p == '^';
+            if (negate) {
+                p++;
+            }
+            bool found = false;
+            unsigned char c = *text;
+            do {
+                unsigned char low = *p == '\\' && p[1] ? *++p : *p;
+                unsigned char high = low;
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    p += 2;
+                    high = *p == '\\' && p[1] ? *++p : *p;
+                }
+                found = found || (c >= low && c <= high);
+                p++;
+            } while (*p && *p != ']');
+            if (*p != ']') {
+                // No closing bracket: '[' is literal.
+                if (*text != '[') {
+                    return false;
+                }
+                pattern++;
+                text++;
+                continue;
+            }
+            if (found == negate) {
+                return false;
+            }
+            pattern = p + 1;
+            text++;
+            continue;
+        }
+        if (*pattern == '\\' && pattern[1]) {
+            pattern++;
+        }
+        if (*pattern != *text) {
+            return false;
+        }
+        pattern++;
+        text++;
+    }
+    return *text == '\0';
+}
+
+// The part of a logged path below the monitored root.
+const char* relative_path(const char* path) {
+    if (strncmp(path, monitor_root.c_str(), monitor_root.size()) != 0) {
+        return path;
+    }
+    path += monitor_root.size();
+    while (*path == '/') {
+        path++;
+    }
+    return path;
+}
+
+// Applies the filter to the entry an event is about. Its directory was
+// checked when it was watched or, with fanotify, resolved.
+bool event_excluded(const SourceEvent& event, bool is_dir) {
+    if (event.dir < 0) {
+        return path_filter.excluded_path(event.name, is_dir);
+    }
+    if (!path_filter.anchored) {
+        return path_filter.excluded(event.name, event.name, is_dir);
+    }
+    static std::string relative;
+    relative.assign(relative_path(watch_path(event.dir).c_str()));
+    if (!relative.empty()) {
+        relative += '/';
+    }
+    size_t name_offset = relative.size();
+    relative += event.name;
+    return path_filter.excluded(relative.c_str(), relative.c_str() + name_offset, is_dir);
+}
+
+void log_event(EventType type, bool is_dir, int wd, const char* name, EventTime when, size_t count, uint32_t cookie) {
+    EventRecord& record = log_history.push();
+    record.time = when;
+    record.type = type;
+    record.is_dir = is_dir;
+    record.wd = wd;
+    record.count = count;
+    record.cookie = cookie;
+    record.name.assign(name);
+    record.from.clear();
+    log_record(record);
+}
+
+void log_rename(const PendingRename& from, int wd, const char* name, EventTime when) {
+    EventRecord& record = log_history.push();
+    record.time = when;
+    record.type = EVENT_RENAMED;
+    record.is_dir = from.is_dir;
+    record.wd = wd;
+    record.count = 1;
+    record.cookie = from.cookie;
+    record.name.assign(name);
+    record.from = from.path;
+    log_record(record);
+}
+
+// Logs the MOVED_FROM events that found no MOVED_TO as moves out of the
+// tree, and stops watching the directories among them.
+void flush_pending_renames() {
+    for (const PendingRename& pending : pending_renames) {
+        log_event(EVENT_MOVED_FROM, pending.is_dir, -1, pending.path.c_str(), pending.time, 1, pending.cookie);
+        if (snapshot_depth() == 0) {
+            snapshot_remove(pending.path, pending.is_dir);
+        }
+        if (pending.is_dir) {
+            event_source->directory_moved_out(pending.dir, pending.name);
+        }
+    }
+    pending_renames.clear();
+}
+
+bool pairs_pending_rename(const SourceEvent& event) {
+    if (!(event.mask & IN_MOVED_TO) || !event.cookie) {
+        return false;
+    }
+    for (const PendingRename& pending : pending_renames) {
+        if (pending.cookie == event.cookie) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hands a record to the journal, stdout and the log file. In curses mode
+// without a log file nothing is formatted here; the display formats only
+// visible rows. Lines for stdout collect in output_buffer, which the event
+// loop writes once per batch. JSON lines are encoded in place there and
+// copied from there into the log writer.
+void log_record(const EventRecord& record) {
+    if (record.type != EVENT_MESSAGE) {
+        metrics.events[record.type]++;
+        if (journal.enabled) {
+            journal.push(record);
+        }
+    }
+    if (use_curses) {
+        display_dirty = true;
+        if (record.type != EVENT_MESSAGE && log_writer.fd < 0) {
+            record_event_latency(record.time, event_clock());
+        }
+        if (log_writer.fd < 0) {
+            return;
+        }
+    }
+
+    if (json_output) {
+        if (record.type == EVENT_MESSAGE) {
+            if (!use_curses) {
+                std::cerr << record.name << std::endl;
+            }
+            return;
+        }
+        size_t start = output_buffer.size();
+        append_json_record(output_buffer, record);
+        if (log_writer.fd >= 0) {
+            log_writer.push_line(output_buffer.data() + start, output_buffer.size() - start, record.time);
+        }
+        if (use_curses) {
+            output_buffer.resize(start);
+            return;
+        }
+        if (log_writer.fd < 0) {
+            metrics.unflushed.push_back(record.time);
+        }
+        if (output_buffer.size() >= OUTPUT_FLUSH_BYTES) {
+            flush_output();
+        }
+        return;
+    }
+
+    std::string line = format_record(record);
+    if (log_writer.fd >= 0) {
+        log_writer.push(line, record.type == EVENT_MESSAGE ? 0 : record.time);
+    }
+    if (!use_curses) {
+        output_buffer += line;
+        output_buffer += '\n';
+        // Events go out once per batch; messages right away, since the
+        // loop may be about to sleep.
+        if (record.type == EVENT_MESSAGE) {
+            flush_output();
+            return;
+        }
+        if (log_writer.fd < 0) {
+            metrics.unflushed.push_back(record.time);
+        }
+        if (output_buffer.size() >= OUTPUT_FLUSH_BYTES) {
+            flush_output();
+        }
+    }
+}
+
+std::string format_record(const EventRecord& record) {
+    if (record.type == EVENT_MESSAGE) {
+        return record.name;
+    }
+    std::string line = format_timestamp(record.time / NS_PER_SEC);
+    line += ' ';
+    line += EVENT_NAMES[record.type];
+    line += record.is_dir ? " directory: " : " file: ";
+    if (record.type == EVENT_RENAMED) {
+        line += record.from;
+        line += " -> ";
+    }
+    if (record.wd >= 0) {
+        line += watch_path(record.wd);
+        line += '/';
+    }
+    line += record.name;
+    if (record.count > 1) {
+        line += " (x" + std::to_string(record.count) + ")";
+    }
+    return line;
+}
+
+// One JSON object per line:
+// {"time_ns":N,"type":"RENAMED","is_dir":false,"path":"...","from":"...","cookie":N,"count":N}
+// "from" is only present for RENAMED. Nothing is allocated once out has
+// grown to its working size.
+void append_json_record(std::string& out, const EventRecord& record) {
+    out += "{\"time_ns\":";
+    append_decimal(out, record.time);
+    out += ",\"type\":\"";
+    out += EVENT_NAMES[record.type];
+    out += record.is_dir ? "\",\"is_dir\":true,\"path\":\"" : "\",\"is_dir\":false,\"path\":\"";
+    if (record.wd >= 0) {
+        const std::string& directory = watch_path(record.wd);
+        append_json_string(out, directory.data(), directory.size());
+        out += '/';
+    }
+    append_json_string(out, record.name.data(), record.name.size());
+    if (record.type == EVENT_RENAMED) {
+        out += "\",\"from\":\"";
+        append_json_string(out, record.from.data(), record.from.size());
+    }
+    out += "\",\"cookie\":";
+    append_decimal(out, record.cookie);
+    out += ",\"count\":";
+    append_decimal(out, static_cast<long long>(record.count));
+    out += "}\n";
+}
+
+// Appends the contents of a JSON string. File names need not be UTF-8 but
+// JSON text must be: valid sequences are copied, every byte that does not
+// start one becomes U+FFFD. Control characters are escaped.
+void append_json_string(std::string& out, const char* data, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + length;
+    while (p < end) {
+        const unsigned char* run = p;
+        while (p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+            p++;
+        }
+        out.append(reinterpret_cast<const char*>(run), p - run);
+        if (p == end) {
+            break;
+        }
+
+        unsigned char c = *p;
+        if (c < 0x80) {
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                default:
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                    break;
+            }
+            p++;
+            continue;
+        }
+
+        // Length of the sequence and the allowed range of its second byte,
+        // which rules out overlong forms, surrogates and values past U+10FFFF.
+        size_t size = 0;
+        unsigned char low = 0x80, high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            size = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            size = 3;
+            low = c == 0xe0 ? 0xa0 : 0x80;
+            high = c == 0xed ? 0x9f : 0xbf;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            size = 4;
+            low = c == 0xf0 ? 0x90 : 0x80;
+            high = c == 0xf4 ? 0x8f : 0xbf;
+        }
+        bool valid = size > 0 && static_cast<size_t>(end - p) >= size && p[1] >= low && p[1] <= high;
+        for (size_t i = 2; valid && i < size; i++) {
+            valid = (p[i] & 0xc0) == 0x80;
+        }
+        if (valid) {
+            out.append(reinterpret_cast<const char*>(p), size);
+            p += size;
+        } else {
+            out += "\xef\xbf\xbd";
+            p++;
+        }
+    }
+}
+
+void append_decimal(std::string& out, long long value) {
+    char digits[24];
+    char* last = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    out.append(digits, last - digits);
+}
+
+void flush_output() {
+    size_t done = 0;
+    while (done < output_buffer.size()) {
+        ssize_t written = write(STDOUT_FILENO, output_buffer.data() + done, output_buffer.size() - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += written;
+    }
+    output_buffer.clear();
+    if (!metrics.unflushed.empty()) {
+        EventTime now = event_clock();
+        for (EventTime read_time : metrics.unflushed) {
+            record_event_latency(read_time, now);
+        }
+        metrics.unflushed.clear();
+    }
+}
+
+// --benchmark: feeds synthetic events through log_event() exactly as the
+// event loop would, in batches of 256, with the configured format, history
+// and log file, and reports the rate on stderr.
+int run_benchmark(size_t events) {
+    static const char* const names[] = {
+        "main.cpp", "build output.o", "caf\xc3\xa9.txt", "quote\"d\\name",
+        "tab\tname", "bad\xff" "byte", "node_modules", "a-much-longer-file-name-for-good-measure.json"
+    };
+    static const EventType types[] = {
+        EVENT_CREATED, EVENT_MODIFIED, EVENT_ATTRIBUTES_CHANGED, EVENT_DELETED, EVENT_MOVED_TO
+    };
+    set_watch(1, -1, "benchmark/src", 0);
+    set_watch(2, 1, "nested directory", 1);
+
+    EventTime first = event_clock();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < events; i++) {
+        log_event(types[i % 5], false, 1 + (i & 1), names[i % 8], first + static_cast<EventTime>(i), 1, 0);
+        if ((i & 255) == 255) {
+            log_writer.pump();
+            journal.pump();
+            flush_output();
+        }
+    }
+    flush_output();
+    std::cout.flush();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Logged " << events << " events in " << static_cast<long long>(seconds * 1000) << " ms ("
+              << static_cast<long long>(events / seconds) << " events/s)" << std::endl;
+    return 0;
+}
+
+const std::string& watch_path(int wd) {
+    static const std::string unknown;
+    auto found = watches.find(wd);
+    if (found == watches.end()) {
+        return unknown;
+    }
+    WatchEntry& entry = found->second;
+    if (entry.path_generation != path_generation) {
+        if (entry.parent >= 0) {
+            entry.path = watch_path(entry.parent);
+            entry.path += '/';
+            entry.path += entry.name;
+        } else {
+            entry.path = entry.name;
+        }
+        entry.path_generation = path_generation;
+    }
+    return entry.path;
+}
+
+std::string entry_path(int wd, const std::string& name) {
+    return wd < 0 ? name : watch_path(wd) + "/" + name;
+}
+
+void EventHistory::reserve(size_t capacity) {
+    records.clear();
+    records.resize(capacity);
+    start = 0;
+    count = 0;
+}
+
+// Returns the slot for a new record, overwriting the oldest one when full.
+EventRecord& EventHistory::push() {
+    pushed++;
+    size_t index = start + count;
+    if (index >= records.size()) {
+        index -= records.size();
+    }
+    if (count < records.size()) {
+        count++;
+    } else if (++start == records.size()) {
+        start = 0;
+    }
+    return records[index];
+}
+
+EventRecord& EventHistory::operator[](size_t index) {
+    index += start;
+    if (index >= records.size()) {
+        index -= records.size();
+    }
+    return records[index];
+}
+
+const EventRecord& EventHistory::operator[](size_t index) const {
+    return const_cast<EventHistory&>(*this)[index];
+}
+
+void flush_pending_modifies(bool force) {
+    if (pending_modifies.empty()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = pending_modifies.begin(); it != pending_modifies.end();) {
+        if (force || it->second.deadline <= now) {
+            log_event(EVENT_MODIFIED, it->second.is_dir, it->first.wd, it->first.name.c_str(), it->second.first_seen, it->second.count);
+            it = pending_modifies.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void flush_pending_modify(const EntryKey& key) {
+    auto pending = pending_modifies.find(key);
+    if (pending != pending_modifies.end()) {
+        log_event(EVENT_MODIFIED, pending->second.is_dir, key.wd, key.name.c_str(), pending->second.first_seen, pending->second.count);
+        pending_modifies.erase(pending);
+    }
+}
+
+// Delay until the earliest coalescing deadline, pending redraw, rescan or
+// spilled log line, or -1 for none.
+int next_wakeup_ms() {
+    auto now = std::chrono::steady_clock::now();
+    auto wakeup = std::chrono::steady_clock::time_point::max();
+    for (const auto& pending : pending_modifies) {
+        wakeup = std::min(wakeup, pending.second.deadline);
+    }
+    if (use_curses && display_dirty) {
+        wakeup = std::min(wakeup, last_redraw + std::chrono::milliseconds(1000 / ui_fps));
+    }
+    if (watch_levels > 0) {
+        wakeup = std::min(wakeup, next_rescan);
+    }
+    if (!log_writer.spill.empty()) {
+        wakeup = std::min(wakeup, now + std::chrono::milliseconds(log_writer.flush_ms));
+    }
+    wakeup = std::min(wakeup, next_metrics_update());
+    if (wakeup == std::chrono::steady_clock::time_point::max()) {
+        return -1;
+    }
+    auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now).count();
+    return static_cast<int>(std::max<long long>(0, delay + 1));
+}
+
+size_t Histogram::index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return static_cast<size_t>(shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+uint64_t Histogram::lowest(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    size_t shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+uint64_t Histogram::highest(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    size_t shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return lowest(index) + ((uint64_t(1) << shift) - 1);
+}
+
+void Histogram::record(uint64_t value) {
+    buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Histogram::snapshot(std::vector<uint64_t>& counts) const {
+    counts.resize(HISTOGRAM_BUCKETS);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+// The highest value of the bucket holding the given per-mille rank of
+// counts (1000 = the maximum), or 0 when counts are empty.
+uint64_t histogram_percentile(const std::vector<uint64_t>& counts, unsigned permille) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (total * permille + 999) / 1000);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return Histogram::highest(i);
+        }
+    }
+    return Histogram::highest(counts.size() - 1);
+}
+
+void record_event_latency(EventTime read_time, EventTime now) {
+    metrics.event_latency.record(now > read_time ? static_cast<uint64_t>(now - read_time) : 0);
+}
+
+void MetricsSample::take() {
+    time = std::chrono::steady_clock::now();
+    std::copy(std::begin(metrics.events), std::end(metrics.events), events);
+    overflows = overflow_count;
+    metrics.batch_sizes.snapshot(batch_sizes);
+    metrics.event_latency.snapshot(event_latency);
+    metrics.write_latency.snapshot(write_latency);
+}
+
+void MetricsSample::subtract(const MetricsSample& earlier) {
+    for (size_t i = 0; i <= EVENT_UNKNOWN; i++) {
+        events[i] -= earlier.events[i];
+    }
+    overflows -= earlier.overflows;
+    for (size_t i = 0; i < earlier.batch_sizes.size(); i++) {
+        batch_sizes[i] -= earlier.batch_sizes[i];
+        event_latency[i] -= earlier.event_latency[i];
+        write_latency[i] -= earlier.write_latency[i];
+    }
+}
+
+uint64_t MetricsSample::total_events() const {
+    uint64_t total = 0;
+    for (uint64_t count : events) {
+        total += count;
+    }
+    return total;
+}
+
+void MetricsWindow::advance() {
+    MetricsSample now;
+    now.take();
+    delta = now;
+    delta.subtract(previous);
+    seconds = previous.batch_sizes.empty() ? 0 : std::chrono::duration<double>(now.time - previous.time).count();
+    previous = std::move(now);
+}
+
+void start_metrics() {
+    auto now = std::chrono::steady_clock::now();
+    stats_window.advance();
+    status_window.advance();
+    next_stats = now + std::chrono::seconds(stats_interval);
+    next_status = now + std::chrono::seconds(1);
+    next_metrics_write = now + std::chrono::seconds(stats_interval > 0 ? stats_interval : METRICS_FILE_INTERVAL);
+}
+
+// Called once per loop iteration: prints the --stats-interval summary,
+// rewrites --metrics-file and refreshes the curses status line when due.
+void update_metrics() {
+    auto now = std::chrono::steady_clock::now();
+    if (use_curses && now >= next_status) {
+        status_window.advance();
+        next_status = now + std::chrono::seconds(1);
+        display_dirty = true;
+    }
+    if (stats_interval > 0 && !use_curses && now >= next_stats) {
+        stats_window.advance();
+        report_stats();
+        next_stats = now + std::chrono::seconds(stats_interval);
+    }
+    if (!metrics_path.empty() && now >= next_metrics_write) {
+        static bool warned = false;
+        std::string error;
+        if (!write_metrics_file(error) && !warned) {
+            log_message("Warning: Could not write metrics file " + metrics_path + ": " + error);
+            warned = true;
+        }
+        next_metrics_write = now + std::chrono::seconds(stats_interval > 0 ? stats_interval : METRICS_FILE_INTERVAL);
+    }
+}
+
+std::chrono::steady_clock::time_point next_metrics_update() {
+    auto next = std::chrono::steady_clock::time_point::max();
+    if (use_curses) {
+        next = std::min(next, next_status);
+    }
+    if (stats_interval > 0 && !use_curses) {
+        next = std::min(next, next_stats);
+    }
+    if (!metrics_path.empty()) {
+        next = std::min(next, next_metrics_write);
+    }
+    return next;
+}
+
+std::string format_duration(uint64_t ns) {
+    char text[32];
+    if (ns < 1000) {
+        snprintf(text, sizeof(text), "%lluns", static_cast<unsigned long long>(ns));
+    } else if (ns < 1000000) {
+        snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+    } else if (ns < static_cast<uint64_t>(NS_PER_SEC)) {
+        snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+    } else {
+        snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+    }
+    return text;
+}
+
+std::string format_rate(double rate) {
+    char text[32];
+    snprintf(text, sizeof(text), rate < 10 ? "%.1f" : "%.0f", rate);
+    return text;
+}
+
+// One --stats-interval summary line on stderr, e.g.
+//   Stats: 1520 events/s (CREATED 700, MODIFIED 820), 38 reads, batch p50 31 max 512,
+//   405 watches, 0 overflows, event-to-log p50 45.0us p99 1.2ms max 3.9ms, log write p99 80.0us
+void report_stats() {
+    const MetricsSample& delta = stats_window.delta;
+    std::string line = "Stats: " + format_rate(stats_window.rate(delta.total_events())) + " events/s";
+    std::string types;
+    for (size_t type = EVENT_CREATED; type <= EVENT_UNKNOWN; type++) {
+        if (delta.events[type] > 0) {
+            types += (types.empty() ? "" : ", ") + std::string(EVENT_NAMES[type]) + " " +
+                     format_rate(stats_window.rate(delta.events[type]));
+        }
+    }
+    if (!types.empty()) {
+        line += " (" + types + ")";
+    }
+    uint64_t reads = 0;
+    for (uint64_t count : delta.batch_sizes) {
+        reads += count;
+    }
+    line += ", " + std::to_string(reads) + " reads";
+    if (reads > 0) {
+        line += ", batch p50 " + std::to_string(histogram_percentile(delta.batch_sizes, 500)) +
+                " max " + std::to_string(histogram_percentile(delta.batch_sizes, 1000));
+    }
+    line += ", " + std::to_string(watches.size()) + " watches, " + std::to_string(delta.overflows) + " overflows";
+    if (delta.total_events() > 0) {
+        line += ", event-to-log p50 " + format_duration(histogram_percentile(delta.event_latency, 500)) +
+                " p99 " + format_duration(histogram_percentile(delta.event_latency, 990)) +
+                " max " + format_duration(histogram_percentile(delta.event_latency, 1000));
+    }
+    if (histogram_percentile(delta.write_latency, 1000) > 0) {
+        line += ", log write p99 " + format_duration(histogram_percentile(delta.write_latency, 990));
+    }
+    std::cerr << line << std::endl;
+}
+
+// Appends a histogram in Prometheus text format. Each bound counts the
+// buckets that lie entirely at or below it, so counts are exact to the
+// histogram's resolution. scale converts recorded values to the unit of
+// the metric.
+void append_prometheus_histogram(std::string& out, const char* name, const char* help, const Histogram& histogram,
+                                 const uint64_t* bounds, size_t bound_count, double scale) {
+    std::vector<uint64_t> counts;
+    histogram.snapshot(counts);
+    char text[160];
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " histogram\n";
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (size_t i = 0; i < bound_count; i++) {
+        while (bucket < counts.size() && Histogram::highest(bucket) <= bounds[i]) {
+            cumulative += counts[bucket++];
+        }
+        snprintf(text, sizeof(text), "%s_bucket{le=\"%g\"} %llu\n", name, bounds[i] * scale,
+                 static_cast<unsigned long long>(cumulative));
+        out += text;
+    }
+    while (bucket < counts.size()) {
+        cumulative += counts[bucket++];
+    }
+    snprintf(text, sizeof(text), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n",
+             name, static_cast<unsigned long long>(cumulative), name,
+             histogram.sum.load(std::memory_order_relaxed) * scale,
+             name, static_cast<unsigned long long>(cumulative));
+    out += text;
+}
+
+void append_prometheus_counter(std::string& out, const char* name, const char* type, const char* help, uint64_t value) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n" + name + " ";
+    append_decimal(out, static_cast<long long>(value));
+    out += '\n';
+}
+
+// --metrics-file: the metrics in Prometheus text format, for example for
+// node_exporter's textfile collector. The file is written next to its
+// final name and renamed over it, so readers never see a partial file.
+bool write_metrics_file(std::string& error) {
+    static const uint64_t batch_bounds[] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384};
+    static const uint64_t latency_bounds[] = {
+        10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+        25000000, 50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000
+    };
+    std::string out;
+    out += "# HELP dirmon_events_total Events logged, by type.\n# TYPE dirmon_events_total counter\n";
+    for (size_t type = EVENT_CREATED; type <= EVENT_UNKNOWN; type++) {
+        out += std::string("dirmon_events_total{type=\"") + EVENT_NAMES[type] + "\"} ";
+        append_decimal(out, static_cast<long long>(metrics.events[type]));
+        out += '\n';
+    }
+    append_prometheus_histogram(out, "dirmon_read_batch_events", "Kernel events returned by one read().",
+                                metrics.batch_sizes, batch_bounds, sizeof(batch_bounds) / sizeof(batch_bounds[0]), 1);
+    append_prometheus_histogram(out, "dirmon_event_to_log_seconds", "Time from reading an event to writing its line.",
+                                metrics.event_latency, latency_bounds, sizeof(latency_bounds) / sizeof(latency_bounds[0]), 1e-9);
+    append_prometheus_histogram(out, "dirmon_log_write_seconds", "Duration of one write to the log file.",
+                                metrics.write_latency, latency_bounds, sizeof(latency_bounds) / sizeof(latency_bounds[0]), 1e-9);
+    append_prometheus_counter(out, "dirmon_watches", "gauge", "Directories currently watched.", watches.size());
+    append_prometheus_counter(out, "dirmon_queue_overflows_total", "counter", "Kernel event queue overflows.", overflow_count);
+    append_prometheus_counter(out, "dirmon_log_lines_dropped_total", "counter", "Log file lines dropped because the buffer was full.",
+                              log_writer.dropped.load());
+    append_prometheus_counter(out, "dirmon_journal_events_dropped_total", "counter", "Journal events dropped because the writer was too slow.",
+                              journal.dropped);
+
+    std::string temporary = metrics_path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0;
+    size_t done = 0;
+    while (ok && done < out.size()) {
+        ssize_t written = write(fd, out.data() + done, out.size() - done);
+        if (written < 0 && errno != EINTR) {
+            ok = false;
+        } else if (written > 0) {
+            done += written;
+        }
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+    if (ok && rename(temporary.c_str(), metrics_path.c_str()) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        error = strerror(errno);
+        unlink(temporary.c_str());
+    }
+    return ok;
+}
+
+void log_message(const std::string& message) {
+    EventRecord& record = log_history.push();
+    record.time = 0;
+    record.type = EVENT_MESSAGE;
+    record.is_dir = false;
+    record.wd = -1;
+    record.count = 1;
+    record.cookie = 0;
+    record.name = message;
+    record.from.clear();
+    log_record(record);
+}
+
+LogWriter::~LogWriter() {
+    stop();
+}
+
+bool LogWriter::start(const std::string& path) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t capacity = 1 << 20;
+    while (capacity < 4 * flush_bytes) {
+        capacity <<= 1;
+    }
+    ring.resize(capacity);
+    ring_mask = capacity - 1;
+    marks.resize(capacity / 64);
+    marks_mask = marks.size() - 1;
+    thread = start_thread(&LogWriter::run, this);
+    return true;
+}
+
+void LogWriter::push(const std::string& message, EventTime time) {
+    std::string line = message + "\n";
+    push_line(line.data(), line.size(), time);
+}
+
+// Queues a line that already ends in a newline. time is the read time of
+// its event, or 0 for messages, which are not sampled.
+void LogWriter::push_line(const char* data, size_t length, EventTime time) {
+    pump();
+    if (spill.empty() && put(data, length)) {
+        mark(time);
+        return;
+    }
+    if (spill.size() + length <= ring.size()) {
+        spill.append(data, length);
+        delayed++;
+        mark(time);
+        return;
+    }
+    dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Moves as much of the spill buffer into the ring as currently fits.
+void LogWriter::pump() {
+    if (spill.empty()) {
+        return;
+    }
+    size_t used = head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire);
+    size_t length = std::min(spill.size(), ring.size() - used);
+    if (length > 0 && put(spill.data(), length)) {
+        spill.erase(0, length);
+    }
+}
+
+bool LogWriter::put(const char* data, size_t length) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t used = h - tail.load(std::memory_order_acquire);
+    if (length > ring.size() - used) {
+        return false;
+    }
+    size_t offset = h & ring_mask;
+    size_t first = std::min(length, ring.size() - offset);
+    memcpy(&ring[offset], data, first);
+    memcpy(&ring[0], data + first, length - first);
+    head.store(h + length, std::memory_order_release);
+
+    // Wake the writer early only when this line crossed the size threshold.
+    // A missed wakeup costs at most one flush interval.
+    if (used < flush_bytes && used + length >= flush_bytes) {
+        wake.notify_one();
+    }
+    return true;
+}
+
+// Marks the end of the line just queued, which lies past everything in
+// the ring and the spill buffer.
+void LogWriter::mark(EventTime time) {
+    size_t h = marks_head.load(std::memory_order_relaxed);
+    if (time == 0 || h - marks_tail.load(std::memory_order_acquire) == marks.size()) {
+        return;
+    }
+    marks[h & marks_mask] = LatencyMark{head.load(std::memory_order_relaxed) + spill.size(), time};
+    marks_head.store(h + 1, std::memory_order_release);
+}
+
+void LogWriter::stop() {
+    if (!thread.joinable()) {
+        return;
+    }
+    while (!spill.empty()) {
+        pump();
+        if (!spill.empty()) {
+            wake.notify_one();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+    close(fd);
+    fd = -1;
+}
+
+void LogWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait_for(lock, std::chrono::milliseconds(flush_ms), [this] {
+            return stopping || head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed) >= flush_bytes;
+        });
+        bool finished = stopping;
+        lock.unlock();
+
+        write_available();
+
+        uint64_t lost = dropped.load(std::memory_order_relaxed);
+        if (lost != dropped_reported) {
+            std::string note = "[dirmon] " + std::to_string(lost - dropped_reported) + " log lines dropped: log buffer full\n";
+            if (write(fd, note.data(), note.size()) < 0) {
+                write_failed = true;
+            }
+            dropped_reported = lost;
+        }
+
+        lock.lock();
+        if (finished) {
+            break;
+        }
+    }
+}
+
+// Writes everything currently in the ring with at most one writev() per
+// wraparound segment pair.
+void LogWriter::write_available() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    while (t != h) {
+        size_t offset = t & ring_mask;
+        size_t length = h - t;
+        size_t first = std::min(length, ring.size() - offset);
+        struct iovec iov[2] = {{&ring[offset], first}, {&ring[0], length - first}};
+        auto started = std::chrono::steady_clock::now();
+        ssize_t written = writev(fd, iov, length > first ? 2 : 1);
+        metrics.write_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            write_failed = true;
+            written = length;
+        }
+        t += written;
+        tail.store(t, std::memory_order_release);
+        sample_written(t);
+    }
+}
+
+// Samples event_latency for the marked lines that end within the first
+// written bytes of the stream.
+void LogWriter::sample_written(size_t written) {
+    size_t t = marks_tail.load(std::memory_order_relaxed);
+    size_t h = marks_head.load(std::memory_order_acquire);
+    if (t == h) {
+        return;
+    }
+    EventTime now = event_clock();
+    while (t != h && marks[t & marks_mask].end <= written) {
+        record_event_latency(marks[t & marks_mask].time, now);
+        t++;
+    }
+    marks_tail.store(t, std::memory_order_release);
+}
+
+JournalWriter::~JournalWriter() {
+    stop();
+}
+
+bool JournalWriter::start(const std::string& journal_path, std::string& error) {
+    path = journal_path;
+    if (!open_file(error)) {
+        return false;
+    }
+    enabled = true;
+    thread = start_thread(&JournalWriter::run, this);
+    return true;
+}
+
+// Opens path for appending. An existing journal is continued: its path
+// table is reloaded, a torn last segment is cut off, and segments written
+// after its newest index go into the next index block. A journal of an
+// older version is rotated away instead.
+bool JournalWriter::open_file(std::string& error) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = strerror(errno);
+        return false;
+    }
+    path_ids.clear();
+    segments.clear();
+    last_index = 0;
+    max_time = INT64_MIN;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        JournalReader reader;
+        std::vector<std::string> paths;
+        if (!reader.load(fd, error) || !reader.read_paths(UINT64_MAX, paths)) {
+            if (error.empty()) {
+                error = "damaged path table";
+            }
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        if (reader.version != JOURNAL_VERSION) {
+            // Segments of another version cannot be appended; start a new
+            // file and keep the old one as FILE.1.
+            close(fd);
+            fd = -1;
+            shift_files();
+            return open_file(error);
+        }
+        for (size_t i = 0; i < paths.size(); i++) {
+            path_ids.emplace(std::move(paths[i]), static_cast<uint32_t>(i));
+        }
+        segments.assign(reader.segments.end() - reader.tail_segments, reader.segments.end());
+        last_index = reader.last_index;
+        max_time = reader.max_time;
+        offset = reader.valid_end;
+        if (offset < reader.size && ftruncate(fd, offset) != 0) {
+            write_failed = true;
+        }
+        return true;
+    }
+
+    JournalHeader header = {};
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.record_size = sizeof(JournalRecord);
+    offset = 0;
+    write_at(&header, sizeof(header), 0);
+    offset = sizeof(header);
+    return true;
+}
+
+void JournalWriter::push(const EventRecord& record) {
+    static const std::string no_directory;
+    const std::string& directory = record.wd >= 0 ? watch_path(record.wd) : no_directory;
+    size_t path_length = record.wd >= 0 ? directory.size() + 1 + record.name.size() : record.name.size();
+    if (path_length > UINT16_MAX || record.from.size() > UINT16_MAX) {
+        dropped++;
+        return;
+    }
+
+    JournalPending entry = {};
+    entry.time = record.time / NS_PER_SEC;
+    entry.count = static_cast<uint32_t>(record.count);
+    entry.path_length = static_cast<uint16_t>(path_length);
+    entry.from_length = static_cast<uint16_t>(record.from.size());
+    entry.type = static_cast<uint8_t>(record.type);
+    entry.is_dir = record.is_dir;
+    staging.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    if (record.wd >= 0) {
+        staging += directory;
+        staging += '/';
+    }
+    staging += record.name;
+    staging += record.from;
+    staged++;
+}
+
+// Hands the staged entries to the writer thread, dropping them if the
+// writer has fallen JOURNAL_MAX_QUEUED bytes behind.
+void JournalWriter::pump() {
+    if (staging.empty()) {
+        return;
+    }
+    bool notify = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queued.size() + staging.size() > JOURNAL_MAX_QUEUED) {
+            dropped += staged;
+        } else if (queued.empty()) {
+            queued.swap(staging);
+        } else {
+            queued += staging;
+        }
+        notify = queued.size() >= flush_bytes;
+    }
+    staging.clear();
+    staged = 0;
+    if (notify) {
+        wake.notify_one();
+    }
+}
+
+void JournalWriter::stop() {
+    if (!thread.joinable()) {
+        return;
+    }
+    pump();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+    enabled = false;
+    close(fd);
+    fd = -1;
+}
+
+void JournalWriter::run() {
+    std::string batch;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait_for(lock, std::chrono::milliseconds(flush_ms), [this] {
+            return stopping || queued.size() >= flush_bytes;
+        });
+        bool finished = stopping;
+        batch.swap(queued);
+        lock.unlock();
+
+        if (!batch.empty()) {
+            write_segment(batch);
+            batch.clear();
+        }
+
+        lock.lock();
+        if (finished && queued.empty()) {
+            break;
+        }
+    }
+    lock.unlock();
+    if (!segments.empty()) {
+        write_index();
+    }
+}
+
+// Appends one segment: a PATHS block for paths not seen before in this
+// file, then the EVENTS block.
+void JournalWriter::write_segment(const std::string& batch) {
+    std::string paths(2 * sizeof(uint32_t), '\0');
+    uint32_t first_id = static_cast<uint32_t>(path_ids.size());
+    uint32_t added = 0;
+    std::vector<JournalRecord> records;
+    JournalSegment segment = {};
+    segment.min_time = INT64_MAX;
+    segment.max_time = INT64_MIN;
+
+    for (size_t pos = 0; pos + sizeof(JournalPending) <= batch.size();) {
+        JournalPending entry;
+        memcpy(&entry, batch.data() + pos, sizeof(entry));
+        pos += sizeof(entry);
+        JournalRecord record = {};
+        record.time = entry.time;
+        record.count = entry.count;
+        record.type = entry.type;
+        record.is_dir = entry.is_dir;
+        record.path = intern(batch.data() + pos, entry.path_length, paths, added);
+        bloom_add_path(segment.path_bloom, batch.data() + pos, entry.path_length);
+        pos += entry.path_length;
+        record.from = JOURNAL_NO_PATH;
+        if (entry.type == EVENT_RENAMED) {
+            record.from = intern(batch.data() + pos, entry.from_length, paths, added);
+            bloom_add_path(segment.path_bloom, batch.data() + pos, entry.from_length);
+        }
+        pos += entry.from_length;
+        records.push_back(record);
+        segment.min_time = std::min(segment.min_time, record.time);
+        segment.max_time = std::max(segment.max_time, record.time);
+        segment.type_mask |= 1u << entry.type;
+    }
+    if (records.empty()) {
+        return;
+    }
+
+    block.clear();
+    if (added > 0) {
+        memcpy(&paths[0], &first_id, sizeof(first_id));
+        memcpy(&paths[sizeof(first_id)], &added, sizeof(added));
+        JournalBlock header = {JOURNAL_PATHS, static_cast<uint32_t>(paths.size())};
+        segment.paths_offset = offset;
+        block.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        block += paths;
+    }
+    JournalBlock header = {JOURNAL_EVENTS, static_cast<uint32_t>(records.size() * sizeof(JournalRecord))};
+    segment.events_offset = offset + block.size();
+    segment.records = static_cast<uint32_t>(records.size());
+    block.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    block.append(reinterpret_cast<const char*>(records.data()), header.length);
+    write_at(block.data(), block.size(), offset);
+    offset += block.size();
+
+    segments.push_back(segment);
+    max_time = std::max(max_time, segment.max_time);
+    if (offset >= max_size) {
+        rotate();
+    } else if (segments.size() >= JOURNAL_INDEX_SEGMENTS) {
+        write_index();
+    }
+}
+
+uint32_t JournalWriter::intern(const char* data, size_t length, std::string& paths, uint32_t& added) {
+    auto inserted = path_ids.emplace(std::string(data, length), static_cast<uint32_t>(path_ids.size()));
+    if (inserted.second) {
+        uint16_t stored = static_cast<uint16_t>(length);
+        paths.append(reinterpret_cast<const char*>(&stored), sizeof(stored));
+        paths.append(data, length);
+        added++;
+    }
+    return inserted.first->second;
+}
+
+// Appends an INDEX block for the segments written since the last one and
+// points the header at it.
+void JournalWriter::write_index() {
+    JournalIndex index = {};
+    index.previous = last_index;
+    index.max_time = max_time;
+    index.segments = static_cast<uint32_t>(segments.size());
+    JournalBlock header = {JOURNAL_INDEX, static_cast<uint32_t>(sizeof(index) + segments.size() * sizeof(JournalSegment))};
+    block.clear();
+    block.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    block.append(reinterpret_cast<const char*>(&index), sizeof(index));
+    block.append(reinterpret_cast<const char*>(segments.data()), segments.size() * sizeof(JournalSegment));
+    write_at(block.data(), block.size(), offset);
+    last_index = offset;
+    offset += block.size();
+    write_at(&last_index, sizeof(last_index), offsetof(JournalHeader, last_index));
+    segments.clear();
+}
+
+void JournalWriter::rotate() {
+    if (!segments.empty()) {
+        write_index();
+    }
+    close(fd);
+    fd = -1;
+    shift_files();
+    std::string error;
+    if (!open_file(error)) {
+        write_failed = true;
+    }
+}
+
+// FILE becomes FILE.1, FILE.1 becomes FILE.2 and so on; the oldest of
+// JOURNAL_ROTATED_FILES is overwritten.
+void JournalWriter::shift_files() {
+    for (int i = JOURNAL_ROTATED_FILES - 1; i >= 1; i--) {
+        rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i + 1)).c_str());
+    }
+    rename(path.c_str(), (path + ".1").c_str());
+}
+
+void JournalWriter::write_at(const void* data, size_t length, uint64_t at) {
+    const char* bytes = static_cast<const char*>(data);
+    while (length > 0 && fd >= 0) {
+        ssize_t written = pwrite(fd, bytes, length, at);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            write_failed = true;
+            return;
+        }
+        bytes += written;
+        length -= written;
+        at += written;
+    }
+}
+
+bool JournalReader::load(int journal_fd, std::string& error) {
+    fd = journal_fd;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        error = strerror(errno);
+        return false;
+    }
+    size = st.st_size;
+    JournalHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+        error = "not a dirmon journal";
+        return false;
+    }
+    if (header.version < 1 || header.version > JOURNAL_VERSION || header.record_size != sizeof(JournalRecord)) {
+        error = "unsupported journal version";
+        return false;
+    }
+    version = header.version;
+    size_t segment_size = version == 1 ? JOURNAL_SEGMENT_V1_SIZE : sizeof(JournalSegment);
+
+    // Walk the index chain backwards, then put the segments in file order.
+    // If the chain is damaged, the whole file is scanned instead.
+    std::vector<std::vector<JournalSegment>> chain;
+    std::vector<char> payload;
+    uint64_t tail = sizeof(header);
+    last_index = header.last_index;
+    for (uint64_t at = header.last_index; at != 0;) {
+        JournalIndex index = {};
+        bool valid = read_block(at, JOURNAL_INDEX, payload) && payload.size() >= sizeof(index);
+        if (valid) {
+            memcpy(&index, payload.data(), sizeof(index));
+            valid = payload.size() == sizeof(index) + index.segments * segment_size &&
+                    (index.previous == 0 || index.previous < at);
+        }
+        if (!valid) {
+            chain.clear();
+            tail = sizeof(header);
+            last_index = 0;
+            max_time = INT64_MIN;
+            break;
+        }
+        if (at == header.last_index) {
+            max_time = index.max_time;
+            tail = at + sizeof(JournalBlock) + payload.size();
+        }
+        chain.emplace_back(index.segments);
+        for (uint32_t i = 0; i < index.segments; i++) {
+            JournalSegment& segment = chain.back()[i];
+            memset(segment.path_bloom, 0xff, sizeof(segment.path_bloom));
+            memcpy(&segment, payload.data() + sizeof(index) + i * segment_size, segment_size);
+        }
+        at = index.previous;
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        segments.insert(segments.end(), it->begin(), it->end());
+    }
+
+    // Scan what was written after the newest index. A block that runs past
+    // the end of the file is the remainder of an interrupted write.
+    valid_end = tail;
+    uint64_t paths_offset = 0;
+    for (uint64_t at = tail; at + sizeof(JournalBlock) <= size;) {
+        JournalBlock block;
+        if (pread(fd, &block, sizeof(block), at) != sizeof(block) || at + sizeof(block) + block.length > size) {
+            break;
+        }
+        uint64_t end = at + sizeof(block) + block.length;
+        if (block.type == JOURNAL_PATHS) {
+            paths_offset = at;
+        } else if (block.type == JOURNAL_EVENTS && block.length % sizeof(JournalRecord) == 0) {
+            if (!read_block(at, JOURNAL_EVENTS, payload)) {
+                break;
+            }
+            JournalSegment segment = {};
+            segment.events_offset = at;
+            segment.paths_offset = paths_offset;
+            segment.min_time = INT64_MAX;
+            segment.max_time = INT64_MIN;
+            segment.records = block.length / sizeof(JournalRecord);
+            memset(segment.path_bloom, 0xff, sizeof(segment.path_bloom));
+            for (uint32_t i = 0; i < segment.records; i++) {
+                JournalRecord record;
+                memcpy(&record, payload.data() + i * sizeof(record), sizeof(record));
+                segment.min_time = std::min(segment.min_time, record.time);
+                segment.max_time = std::max(segment.max_time, record.time);
+                segment.type_mask |= 1u << record.type;
+            }
+            segments.push_back(segment);
+            tail_segments++;
+            max_time = std::max(max_time, segment.max_time);
+            paths_offset = 0;
+            valid_end = end;
+        } else if (block.type == JOURNAL_INDEX) {
+            // Written just before the header update was lost; it covers
+            // the segments scanned so far.
+            last_index = at;
+            tail_segments = 0;
+            valid_end = end;
+        } else {
+            break;
+        }
+        at = end;
+    }
+    return true;
+}
+
+bool JournalReader::read_block(uint64_t offset, uint32_t type, std::vector<char>& payload) {
+    JournalBlock block;
+    if (pread(fd, &block, sizeof(block), offset) != sizeof(block) || block.type != type ||
+        offset + sizeof(block) + block.length > size) {
+        return false;
+    }
+    payload.resize(block.length);
+    return pread(fd, payload.data(), block.length, offset + sizeof(block)) == static_cast<ssize_t>(block.length);
+}
+
+// Loads the paths defined by PATHS blocks before offset until.
+bool JournalReader::read_paths(uint64_t until, std::vector<std::string>& paths) {
+    std::vector<char> payload;
+    for (const JournalSegment& segment : segments) {
+        if (segment.paths_offset == 0) {
+            continue;
+        }
+        if (segment.paths_offset >= until) {
+            break;
+        }
+        uint32_t first_id;
+        uint32_t count;
+        if (!read_block(segment.paths_offset, JOURNAL_PATHS, payload) || payload.size() < sizeof(first_id) + sizeof(count)) {
+            return false;
+        }
+        memcpy(&first_id, payload.data(), sizeof(first_id));
+        memcpy(&count, payload.data() + sizeof(first_id), sizeof(count));
+        paths.resize(first_id);
+        size_t pos = sizeof(first_id) + sizeof(count);
+        for (uint32_t i = 0; i < count; i++) {
+            uint16_t length;
+            if (pos + sizeof(length) > payload.size()) {
+                return false;
+            }
+            memcpy(&length, payload.data() + pos, sizeof(length));
+            pos += sizeof(length);
+            if (pos + length > payload.size()) {
+                return false;
+            }
+            paths.emplace_back(payload.data() + pos, length);
+            pos += length;
+        }
+    }
+    return true;
+}
+
+int run_query(const std::string& path, const JournalQuery& query) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        std::cerr << "Error: Could not open journal " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::ios::sync_with_stdio(false);
+    try {
+        for (int i = JOURNAL_ROTATED_FILES; i >= 1; i--) {
+            std::string rotated = path + "." + std::to_string(i);
+            if (stat(rotated.c_str(), &st) == 0) {
+                query_file(rotated, query);
+            }
+        }
+        query_file(path, query);
+    } catch (const std::exception& e) {
+        std::cout.flush();
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout.flush();
+    return 0;
+}
+
+// Prints the matching events of one journal file. Segments outside the
+// time range, without a wanted event type or, going by their path_bloom,
+// without a path below the prefix are skipped using the index; only the
+// EVENTS blocks of the others and the path table are read.
+void query_file(const std::string& path, const JournalQuery& query) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open journal " + path + ": " + strerror(errno));
+    }
+    JournalReader reader;
+    std::string error;
+    if (!reader.load(fd, error)) {
+        close(fd);
+        throw std::runtime_error(path + ": " + error);
+    }
+
+    std::vector<const JournalSegment*> selected;
+    if (reader.max_time >= query.since) {
+        for (const JournalSegment& segment : reader.segments) {
+            if (segment.max_time >= query.since && segment.min_time < query.until &&
+                (segment.type_mask & query.type_mask) != 0 && bloom_has_prefix(segment.path_bloom, query.prefix)) {
+                selected.push_back(&segment);
+            }
+        }
+    }
+    std::vector<std::string> paths;
+    if (selected.empty() || !reader.read_paths(selected.back()->events_offset, paths)) {
+        close(fd);
+        if (!selected.empty()) {
+            throw std::runtime_error(path + ": damaged path table");
+        }
+        return;
+    }
+
+    // Prefix matches per path id: 0 unknown, 1 yes, 2 no.
+    std::vector<uint8_t> matches(paths.size(), query.prefix.empty() ? 1 : 0);
+    std::vector<char> payload;
+    EventRecord line;
+    for (const JournalSegment* segment : selected) {
+        if (!reader.read_block(segment->events_offset, JOURNAL_EVENTS, payload)) {
+            close(fd);
+            throw std::runtime_error(path + ": damaged event block at offset " + std::to_string(segment->events_offset));
+        }
+        for (size_t pos = 0; pos + sizeof(JournalRecord) <= payload.size(); pos += sizeof(JournalRecord)) {
+            JournalRecord record;
+            memcpy(&record, payload.data() + pos, sizeof(record));
+            if (record.time < query.since || record.time >= query.until || record.type > EVENT_UNKNOWN ||
+                !(query.type_mask & (1u << record.type)) || record.path >= paths.size()) {
+                continue;
+            }
+            if (matches[record.path] == 0) {
+                matches[record.path] = path_has_prefix(paths[record.path], query.prefix) ? 1 : 2;
+            }
+            bool renamed_from = record.from < paths.size() && path_has_prefix(paths[record.from], query.prefix);
+            if (matches[record.path] != 1 && !renamed_from) {
+                continue;
+            }
+            line.time = record.time * NS_PER_SEC;
+            line.type = static_cast<EventType>(record.type);
+            line.is_dir = record.is_dir;
+            line.wd = -1;
+            line.count = record.count;
+            line.name = paths[record.path];
+            if (record.from < paths.size()) {
+                line.from = paths[record.from];
+            } else {
+                line.from.clear();
+            }
+            std::cout << format_record(line) << '\n';
+        }
+    }
+    close(fd);
+}
+
+// True if path is prefix or lies below it.
+bool path_has_prefix(const std::string& path, const std::string& prefix) {
+    if (prefix.empty()) {
+        return true;
+    }
+    if (path.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    return path.size() == prefix.size() || prefix.back() == '/' || path[prefix.size()] == '/';
+}
+
+// The two filter bits of one path, from a 64-bit FNV-1a hash.
+void bloom_bits(const char* data, size_t length, size_t bits[2]) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    bits[0] = hash % (JOURNAL_BLOOM_WORDS * 64);
+    bits[1] = (hash >> 32) % (JOURNAL_BLOOM_WORDS * 64);
+}
+
+// Adds path and each directory above it, e.g. "/a/b" adds "/a" and "/a/b".
+void bloom_add_path(uint64_t* bloom, const char* path, size_t length) {
+    size_t bits[2];
+    for (size_t i = 1; i <= length; i++) {
+        if (i == length || path[i] == '/') {
+            bloom_bits(path, i, bits);
+            bloom[bits[0] / 64] |= 1ull << (bits[0] % 64);
+            bloom[bits[1] / 64] |= 1ull << (bits[1] % 64);
+        }
+    }
+}
+
+// False only if no path in the filter can match path_has_prefix(prefix).
+// A trailing '/' asks for paths below the directory, which was added as
+// an ancestor of each of them.
+bool bloom_has_prefix(const uint64_t* bloom, const std::string& prefix) {
+    size_t length = prefix.size();
+    if (length > 0 && prefix.back() == '/') {
+        length--;
+    }
+    if (length == 0) {
+        return true;
+    }
+    size_t bits[2];
+    bloom_bits(prefix.data(), length, bits);
+    return (bloom[bits[0] / 64] >> (bits[0] % 64) & 1) && (bloom[bits[1] / 64] >> (bits[1] % 64) & 1);
+}
+
+// Accepts "YYYY-MM-DD HH:MM[:SS]", "YYYY-MM-DD", "HH:MM[:SS]" (today) in
+// local time, or "@SECONDS" since the epoch.
+bool parse_time(const char* text, int64_t& result) {
+    if (text[0] == '@') {
+        char* end;
+        errno = 0;
+        long long seconds = strtoll(text + 1, &end, 10);
+        if (errno != 0 || end == text + 1 || *end != '\0') {
+            return false;
+        }
+        result = seconds;
+        return true;
+    }
+    static const char* const date_formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+    static const char* const time_formats[] = {"%H:%M:%S", "%H:%M"};
+    for (const char* format : date_formats) {
+        struct tm tm = {};
+        const char* end = strptime(text, format, &tm);
+        if (end != nullptr && *end == '\0') {
+            tm.tm_isdst = -1;
+            result = mktime(&tm);
+            return true;
+        }
+    }
+    for (const char* format : time_formats) {
+        struct tm tm = {};
+        const char* end = strptime(text, format, &tm);
+        if (end != nullptr && *end == '\0') {
+            time_t now = time(nullptr);
+            struct tm today;
+            localtime_r(&now, &today);
+            today.tm_hour = tm.tm_hour;
+            today.tm_min = tm.tm_min;
+            today.tm_sec = tm.tm_sec;
+            today.tm_isdst = -1;
+            result = mktime(&today);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A comma-separated list of event names, case-insensitive.
+bool parse_event_types(const char* text, uint32_t& mask) {
+    mask = 0;
+    std::string list = text;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string name = list.substr(start, end - start);
+        bool found = false;
+        for (int type = EVENT_CREATED; type <= EVENT_UNKNOWN; type++) {
+            if (strcasecmp(name.c_str(), EVENT_NAMES[type]) == 0) {
+                mask |= 1u << type;
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// A byte count with an optional K, M or G suffix.
+bool parse_size(const char* text, uint64_t& result) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return false;
+    }
+    switch (*end) {
+        case 'K': case 'k': value <<= 10; end++; break;
+        case 'M': case 'm': value <<= 20; end++; break;
+        case 'G': case 'g': value <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value == 0) {
+        return false;
+    }
+    result = value;
+    return true;
+}
+
+void signal_handler(int signum) {
+    (void)signum;
+    interrupted = 1;
+}
+
+// From here on SIGINT, SIGTERM and SIGWINCH are read from signal_fd, so
+// that they are handled between batches and shutdown can flush everything.
+// Until then signal_handler() covers startup.
+bool setup_event_loop() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || signal_fd < 0 || timer_fd < 0) {
+        log_message("Error: Could not set up the event loop");
+        return false;
+    }
+
+    std::vector<int> fds = {event_source->poll_fd(), signal_fd, timer_fd};
+    if (use_curses) {
+        nodelay(stdscr, TRUE);
+        fds.push_back(STDIN_FILENO);
+    }
+    for (int fd : fds) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            log_message("Error: Could not set up the event loop");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Arms timer_fd to fire after delay_ms, or disarms it for -1.
+void arm_timer(int delay_ms) {
+    struct itimerspec timer = {};
+    if (delay_ms >= 0) {
+        timer.it_value.tv_sec = delay_ms / 1000;
+        timer.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+        if (delay_ms == 0) {
+            timer.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(timer_fd, 0, &timer, nullptr);
+}
+
+// Returns false once SIGINT or SIGTERM arrived.
+bool handle_signals() {
+    bool running = true;
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGWINCH) {
+            if (use_curses) {
+                resize_curses();
+            }
+        } else {
+            running = false;
+        }
+    }
+    return running;
+}
+
+// Curses keys: q quits, p or space pauses, / edits the filter and Esc
+// clears it, arrows, Page Up/Down, Home and End scroll. Returns false on q.
+bool handle_keys() {
+    int page = std::max(1, LINES - 3);
+    int ch;
+    bool changed = false;
+    while ((ch = getch()) != ERR) {
+        changed = true;
+        if (editing_filter) {
+            if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
+                view_filter = filter_edit;
+                editing_filter = false;
+                scroll_offset = 0;
+            } else if (ch == 27) {
+                editing_filter = false;
+            } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+                if (!filter_edit.empty()) {
+                    filter_edit.pop_back();
+                }
+            } else if (ch >= 32 && ch < 256) {
+                filter_edit += static_cast<char>(ch);
+            }
+            continue;
+        }
+        switch (ch) {
+            case 'q':
+            case 'Q':
+                return false;
+            case 'p':
+            case ' ':
+                ui_paused = !ui_paused;
+                paused_new = 0;
+                if (!ui_paused) {
+                    scroll_offset = 0;
+                }
+                break;
+            case '/':
+                editing_filter = true;
+                filter_edit = view_filter;
+                break;
+            case 27:
+                view_filter.clear();
+                scroll_offset = 0;
+                break;
+            case KEY_UP:
+                scroll_offset++;
+                break;
+            case KEY_DOWN:
+                scroll_offset -= std::min<size_t>(scroll_offset, 1);
+                break;
+            case KEY_PPAGE:
+                scroll_offset += page;
+                break;
+            case KEY_NPAGE:
+                scroll_offset -= std::min<size_t>(scroll_offset, page);
+                break;
+            case KEY_HOME:
+                scroll_offset = log_history.size();
+                break;
+            case KEY_END:
+                scroll_offset = 0;
+                break;
+            case KEY_RESIZE:
+                // Queued by resizeterm() in resize_curses(); already handled.
+                break;
+            default:
+                break;
+        }
+    }
+    if (changed) {
+        redraw_curses_display();
+    }
+    return true;
+}
+
+std::string get_current_time() {
+    return format_timestamp(time(nullptr));
+}
+
+EventTime event_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<EventTime>(now.tv_sec) * NS_PER_SEC + now.tv_nsec;
+}
+
+// localtime() and strftime() only run when the second changes.
+const std::string& format_timestamp(time_t when) {
+    static time_t cached_time = -1;
+    static std::string cached;
+    if (when != cached_time) {
+        char buffer[80];
+        struct tm timeinfo;
+        localtime_r(&when, &timeinfo);
+        strftime(buffer, sizeof(buffer), "[%Y-%m-%d %H:%M:%S]", &timeinfo);
+        cached = buffer;
+        cached_time = when;
+    }
+    return cached;
+}
+
+void print_usage() {
+    std::cout << "Usage: dirmon [OPTIONS] DIRECTORY" << std::endl;
+    std::cout << "Monitor a directory and log all changes (add, remove, edit) in real-time." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -l, --log-file=FILE    Log events to FILE" << std::endl;
+    std::cout << "  -c, --curses           Use curses UI with live file change feed" << std::endl;
+    std::cout << "  -w, --coalesce-ms=MS   Merge repeated MODIFY events on a path within MS (default: 100, 0 = off)" << std::endl;
+    std::cout << "  -f, --fps=N            Maximum curses redraws per second (default: 20)" << std::endl;
+    std::cout << "  -M, --flush-ms=MS      Write buffered log lines at least every MS (default: 200)" << std::endl;
+    std::cout << "  -B, --flush-bytes=N    Write early once N bytes are buffered (default: 65536)" << std::endl;
+    std::cout << "  -H, --history=N        Number of events kept for the curses view (default: 1000)" << std::endl;
+    std::cout << "  -j, --jobs=N           Threads for the initial directory scan (default: number of CPUs)" << std::endl;
+    std::cout << "  -d, --watch-depth=N    Only watch the top N directory levels and rescan deeper ones (default: all," << std::endl;
+    std::cout << "                         reduced automatically when fs.inotify.max_user_watches is too low)" << std::endl;
+    std::cout << "  -r, --rescan-interval=SEC  Seconds between rescans of unwatched directories (default: 60)" << std::endl;
+    std::cout << "  -S, --snapshot         Keep a snapshot of the tree for recovering from queue overflows" << std::endl;
+    std::cout << "  -F, --format=FORMAT    Output format: text or jsonl (one JSON object per event; default: text)" << std::endl;
+    std::cout << "  -X, --benchmark=N      Log N synthetic events without monitoring and report the rate on stderr" << std::endl;
+    std::cout << "  -x, --exclude=PATTERN  Ignore entries matching a gitignore-style PATTERN and do not watch" << std::endl;
+    std::cout << "                         excluded directories (repeatable)" << std::endl;
+    std::cout << "  -i, --include=PATTERN  Include matching entries again; the last matching rule wins (repeatable)" << std::endl;
+    std::cout << "  -E, --exclude-from=FILE  Read rules from a gitignore-style FILE ('!' lines include)" << std::endl;
+    std::cout << "  -J, --journal=FILE     Also record events in a binary journal FILE for --query" << std::endl;
+    std::cout << "  -Z, --journal-size=N   Rotate the journal once it reaches N bytes (K, M, G suffixes; default: 256M)" << std::endl;
+    std::cout << "  -I, --stats-interval=SEC  Print event rates, read batch sizes and latencies to stderr every SEC" << std::endl;
+    std::cout << "                         seconds (not in curses mode)" << std::endl;
+    std::cout << "  -P, --metrics-file=FILE  Keep metrics in Prometheus text format in FILE, rewritten atomically" << std::endl;
+    std::cout << "                         every --stats-interval (default: 10) seconds" << std::endl;
+    std::cout << "  -b, --backend=NAME     Event source: auto, inotify or fanotify (default: auto, which uses" << std::endl;
+    std::cout << "                         fanotify when permitted and inotify otherwise)" << std::endl;
+    std::cout << "  -h, --help             Display this help and exit" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Usage: dirmon --query [QUERY OPTIONS] JOURNAL" << std::endl;
+    std::cout << "Print journaled events of JOURNAL and its rotated files, oldest first." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Query options:" << std::endl;
+    std::cout << "  -s, --since=TIME       Only events at or after TIME ([YYYY-MM-DD] HH:MM[:SS] or @SECONDS)" << std::endl;
+    std::cout << "  -u, --until=TIME       Only events before TIME" << std::endl;
+    std::cout << "  -p, --path=PREFIX      Only events on PREFIX or below it, as paths were logged" << std::endl;
+    std::cout << "  -t, --type=LIST        Only these comma-separated event types (e.g. CREATED,DELETED)" << std::endl;
+}
+
+void setup_curses() {
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    set_escdelay(25);
+    start_color();
+    init_pair(1, COLOR_GREEN, COLOR_BLACK);
+    init_pair(2, COLOR_RED, COLOR_BLACK);
+    init_pair(3, COLOR_YELLOW, COLOR_BLACK);
+    init_pair(4, COLOR_BLUE, COLOR_BLACK);
+    init_pair(5, COLOR_CYAN, COLOR_BLACK);
+    refresh();
+}
+
+void cleanup_curses() {
+    endwin();
+}
+
+void maybe_update_curses_display() {
+    auto now = std::chrono::steady_clock::now();
+    if (display_dirty && now - last_redraw >= std::chrono::milliseconds(1000 / ui_fps)) {
+        redraw_curses_display();
+    }
+}
+
+void redraw_curses_display() {
+    update_curses_display();
+    last_redraw = std::chrono::steady_clock::now();
+    display_dirty = false;
+}
+
+// SIGWINCH is read from signal_fd, so curses does not see it by itself.
+// resizeterm() also queues a KEY_RESIZE, which handle_keys() ignores.
+void resize_curses() {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 && size.ws_col > 0) {
+        resizeterm(size.ws_row, size.ws_col);
+    }
+    redraw_curses_display();
+}
+
+bool record_visible(const EventRecord& record) {
+    return view_filter.empty() || format_record(record).find(view_filter) != std::string::npos;
+}
+
+void update_curses_display() {
+    erase();
+
+    int max_y, max_x;
+    getmaxyx(stdscr, max_y, max_x);
+
+    // Keep the same lines in view while paused or scrolled back.
+    size_t arrived = std::min<uint64_t>(log_history.pushed - view_pushed, log_history.size());
+    view_pushed = log_history.pushed;
+    if (ui_paused || scroll_offset > 0) {
+        for (size_t i = log_history.size() - arrived; i < log_history.size(); ++i) {
+            if (record_visible(log_history[i])) {
+                scroll_offset++;
+                paused_new += ui_paused;
+            }
+        }
+    }
+
+    // Rows to show, newest first, skipping scroll_offset matching lines.
+    size_t display_lines = static_cast<size_t>(std::max(0, max_y - 3));
+    std::vector<size_t> rows;
+    size_t end = log_history.size();
+    if (view_filter.empty()) {
+        end -= std::min(scroll_offset, end);
+    }
+    size_t matching = 0;
+    for (size_t i = end; i-- > 0 && rows.size() < display_lines;) {
+        if (view_filter.empty() || (record_visible(log_history[i]) && matching++ >= scroll_offset)) {
+            rows.push_back(i);
+        }
+    }
+    if (rows.size() < display_lines && scroll_offset > 0) {
+        // Scrolled past the oldest line: show the first page instead.
+        scroll_offset -= std::min(scroll_offset, display_lines - rows.size());
+        update_curses_display();
+        return;
+    }
+
+    attron(A_BOLD);
+    mvprintw(0, 0, "Directory Monitor - q quit, p pause, / filter, arrows scroll");
+    attroff(A_BOLD);
+    std::string status;
+    if (ui_paused) {
+        status = "PAUSED";
+        if (paused_new > 0) {
+            status += " (" + std::to_string(paused_new) + " new)";
+        }
+    } else if (scroll_offset > 0) {
+        status = "-" + std::to_string(scroll_offset) + " lines";
+    }
+    if (!view_filter.empty()) {
+        status += (status.empty() ? "filter: " : "  filter: ") + view_filter;
+    }
+    if (!status.empty() && static_cast<int>(status.size()) < max_x) {
+        attron(A_REVERSE);
+        mvprintw(0, max_x - static_cast<int>(status.size()), "%s", status.c_str());
+        attroff(A_REVERSE);
+    }
+
+    mvhline(1, 0, ACS_HLINE, max_x);
+
+    for (size_t row = rows.size(), line = 2; row-- > 0; ++line) {
+        const EventRecord& record = log_history[rows[row]];
+        std::string entry = format_record(record);
+
+        switch (record.type) {
+            case EVENT_CREATED:
+                attron(COLOR_PAIR(1));
+                break;
+            case EVENT_DELETED:
+                attron(COLOR_PAIR(2));
+                break;
+            case EVENT_MODIFIED:
+                attron(COLOR_PAIR(3));
+                break;
+            case EVENT_MOVED_FROM:
+            case EVENT_MOVED_TO:
+            case EVENT_RENAMED:
+                attron(COLOR_PAIR(4));
+                break;
+            case EVENT_ATTRIBUTES_CHANGED:
+                attron(COLOR_PAIR(5));
+                break;
+            default:
+                break;
+        }
+        
+        if (entry.length() > static_cast<size_t>(max_x)) {
+            mvprintw(line, 0, "%s", entry.substr(0, max_x - 3).c_str());
+            mvprintw(line, max_x - 3, "...");
+        } else {
+            mvprintw(line, 0, "%s", entry.c_str());
+        }
+        
+        attroff(COLOR_PAIR(1) | COLOR_PAIR(2) | COLOR_PAIR(3) | COLOR_PAIR(4) | COLOR_PAIR(5));
+    }
+
+    if (editing_filter) {
+        mvprintw(max_y - 1, 0, "Filter: %s", filter_edit.c_str());
+    } else {
+        const MetricsSample& delta = status_window.delta;
+        std::string metrics_line = format_rate(status_window.rate(delta.total_events())) + " events/s | " +
+                                   std::to_string(watches.size()) + " watches | " +
+                                   std::to_string(overflow_count) + " overflows | event-to-log p99 " +
+                                   format_duration(histogram_percentile(delta.event_latency, 990));
+        attron(A_DIM);
+        mvprintw(max_y - 1, 0, "%s", metrics_line.substr(0, static_cast<size_t>(std::max(0, max_x - 1))).c_str());
+        attroff(A_DIM);
     }
-    
     refresh();
 }
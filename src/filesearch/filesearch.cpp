@@ -18,26 +18,303 @@
 #include <functional>
 #include <cctype>
 #include <pwd.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <condition_variable>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <climits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-std::string get_cache_file_path() {
+std::string get_home_dir() {
     const char* home_dir = getenv("HOME");
     if (!home_dir) {
         home_dir = getpwuid(getuid())->pw_dir;
     }
-    return std::string(home_dir) + "/.filesearch_cache";
+    return home_dir;
 }
 
+std::string get_legacy_cache_path() {
+    return get_home_dir() + "/.filesearch_cache";
+}
+
+std::string get_cache_dir() {
+    return get_home_dir() + "/.filesearch_cache.d";
+}
+
+// One cache file per root, named by the FNV-1a hash of the root path.
+std::string get_cache_file_path(const std::string& root) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : root) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.cache", static_cast<unsigned long long>(hash));
+    return get_cache_dir() + name;
+}
+
+std::string join_path(const std::string& dir, const char* name) {
+    return dir == "/" ? dir + name : dir + "/" + name;
+}
+
+// Strings live in the owning FileCache's pool; the name is the tail of the path.
+// This is also the on-disk entry layout of the V2 cache.
 struct FileInfo {
+    uint64_t path_offset;
+    uint32_t path_length;
+    uint32_t name_length;
+    int64_t modified_time;
+};
+
+// Search key of a file: a bitmask of the bytes in its lowercased name, used to
+// reject candidates before scoring, and the name's offset in the lowercase pool.
+struct NameKey {
+    uint64_t char_mask;
+    uint32_t lower_offset;
+    uint32_t length;
+};
+
+// The lowercase pool always ends with this many zero bytes so the SIMD matcher
+// can load whole vectors past the end of the last name.
+const size_t LOWER_POOL_PADDING = 64;
+
+// Posting list of one trigram (three lowercased name bytes packed big-endian):
+// `count` ascending file indices starting at `offset` in the postings array.
+struct TrigramEntry {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;
+};
+
+// Directories are stored in pre-order, so a directory's subtree is a contiguous
+// range of both the directory table and the file table.
+struct DirInfo {
+    uint64_t path_offset;
+    uint32_t path_length;
+    uint32_t subtree_dirs;
+    uint64_t first_file;
+    uint64_t subtree_files;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+// Entries and string pool either point into the mmap'd V2 cache file or into
+// owned buffers filled by a crawl or a V1 cache upgrade.
+struct FileCache {
+    const FileInfo* entries = nullptr;
+    size_t count = 0;
+    const DirInfo* dirs = nullptr;
+    size_t dir_count = 0;
+    const char* pool = nullptr;
+    size_t pool_size = 0;
+    const NameKey* keys = nullptr;
+    const char* lower_pool = nullptr;
+    size_t lower_pool_size = 0;
+    std::vector<FileInfo> owned_entries;
+    std::vector<DirInfo> owned_dirs;
+    std::string owned_pool;
+    std::vector<NameKey> owned_keys;
+    std::string owned_lower_pool;
+    const TrigramEntry* trigrams = nullptr;
+    size_t trigram_count = 0;
+    const uint32_t* postings = nullptr;
+    size_t posting_count = 0;
+    std::vector<TrigramEntry> owned_trigrams;
+    std::vector<uint32_t> owned_postings;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    size_t scope_begin = 0;
+    size_t scope_end = 0;
+
+    FileCache() = default;
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+    FileCache& operator=(FileCache&& other);
+    ~FileCache();
+    void clear();
+    void add(std::string_view path, size_t name_length, time_t mtime);
+    size_t add_dir(std::string_view path, const struct timespec& mtime);
+    void close_dir(size_t index);
+    void update_pointers();
+    bool set_scope(std::string_view root, std::string_view dir);
+    size_t find_dir(std::string_view dir) const;
+    void build_trigram_index();
+    bool has_trigram_index() const { return trigram_count > 0; }
+    void trigram_candidates(const std::string& lower, size_t begin, size_t end, std::vector<size_t>& out) const;
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    const FileInfo* begin() const { return entries; }
+    const FileInfo* end() const { return entries + count; }
+    const FileInfo& operator[](size_t i) const { return entries[i]; }
+
+    std::string_view path(const FileInfo& file) const {
+        return std::string_view(pool + file.path_offset, file.path_length);
+    }
+    std::string_view name(const FileInfo& file) const {
+        return std::string_view(pool + file.path_offset + file.path_length - file.name_length, file.name_length);
+    }
+    std::string_view path(const DirInfo& dir) const {
+        return std::string_view(pool + dir.path_offset, dir.path_length);
+    }
+    const char* lower_name(size_t i) const {
+        return lower_pool + keys[i].lower_offset;
+    }
+};
+
+// A query lowercased once, with the byte mask every candidate name must cover.
+struct FuzzyPattern {
+    std::string lower;
+    uint64_t char_mask;
+
+    explicit FuzzyPattern(const std::string& pattern);
+};
+
+struct Match {
+    int score;
+    size_t index;
+};
+
+// Optional parts of find_matches(): score only the cache indices in candidates
+// (begin/end then index that vector), collect every matching index in order,
+// and give up early once cancelled is set. skip lists ascending indices that
+// were already scored, and seed their best matches. With max_score set, a
+// chunk stops once its best matches beat anything left in it and sets
+// stopped_early.
+struct MatchOptions {
+    const std::vector<size_t>* candidates = nullptr;
+    std::vector<size_t>* matched = nullptr;
+    const std::atomic<bool>* cancelled = nullptr;
+    const std::vector<size_t>* skip = nullptr;
+    const std::vector<Match>* seed = nullptr;
+    int max_score = INT_MAX;
+    std::atomic<bool>* stopped_early = nullptr;
+};
+
+// Runs interactive queries on a background thread. Submitting a query cancels
+// the one in progress. A query that extends the last completed one only rescores
+// that query's matches; anything else (e.g. after a deletion) rescans the cache.
+struct SearchWorker {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+    std::atomic<bool> cancelled{false};
+    bool stopping = false;
+    bool has_request = false;
+    std::string request;
+    bool has_result = false;
+    std::string result_query;
+    std::vector<Match> results;
+    size_t result_total = 0;
+    bool result_total_exact = true;
+    std::string narrowed_query;
+    std::vector<size_t> narrowed_matches;
+
+    SearchWorker();
+    ~SearchWorker();
+    void submit(const std::string& query);
+    bool take_result(std::string& query, std::vector<Match>& matches, size_t& total, bool& total_exact);
+    void run();
+    void search(const std::string& query);
+};
+
+struct CacheHeader {
+    char magic[24];
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t entry_size;
+    uint32_t reserved;
+    int64_t timestamp;
+    uint64_t root_offset;
+    uint64_t root_length;
+    uint64_t entry_count;
+    uint64_t entries_offset;
+    uint64_t dir_count;
+    uint64_t dirs_offset;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+    uint64_t keys_offset;
+    uint64_t lower_pool_offset;
+    uint64_t lower_pool_size;
+    uint64_t trigram_count;
+    uint64_t trigrams_offset;
+    uint64_t posting_count;
+    uint64_t postings_offset;
+};
+
+const char CACHE_MAGIC_V1[] = "FILESEARCH_CACHE_V1";
+const char CACHE_MAGIC_V2[] = "FILESEARCH_CACHE_V2";
+const uint32_t CACHE_BYTE_ORDER = 0x01020304;
+
+struct CrawlFile {
     std::string path;
-    std::string name;
+    uint32_t name_length;
     time_t modified_time;
-    
-    FileInfo(const std::string& p, const std::string& n, time_t mt)
-        : path(p), name(n), modified_time(mt) {}
 };
 
-std::vector<FileInfo> file_cache;
+struct CrawlNode {
+    std::string path;
+    struct timespec mtime = {0, 0};
+    int64_t cached_dir = -1;
+    std::vector<CrawlFile> files;
+    std::vector<std::pair<size_t, CrawlNode*>> subdirs;
+};
+
+struct CrawlQueue {
+    std::mutex mutex;
+    std::deque<CrawlNode*> tasks;
+};
+
+// Work-stealing directory crawler. Each worker owns a queue and a shard of
+// nodes; the node tree keeps readdir order so merge() reproduces the serial walk.
+// With a previous cache, directories whose mtime is unchanged are not re-read.
+// Workers that find every queue empty sleep on idle until a directory is
+// queued or the crawl is over, instead of spinning while others wait on I/O.
+struct Crawler {
+    std::vector<std::unique_ptr<CrawlQueue>> queues;
+    std::vector<std::deque<CrawlNode>> shards;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> sleeping{0};
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    const FileCache* previous = nullptr;
+
+    explicit Crawler(int jobs, const FileCache* previous_cache = nullptr);
+    void crawl(const std::string& root, FileCache& out);
+    void worker(size_t id);
+    void push(size_t id, CrawlNode* node);
+    void wake(bool all);
+    CrawlNode* next_task(size_t id);
+    CrawlNode* add_child(size_t id, CrawlNode* node, std::string path, int64_t cached_dir);
+    bool reuse(size_t id, CrawlNode* node);
+    void scan(size_t id, CrawlNode* node);
+    void merge(CrawlNode* node, FileCache& out);
+};
+
+FileCache file_cache;
+std::string cache_root;
 bool rebuild_cache = false;
+bool force_refresh = false;
+bool cache_dirty = false;
+time_t cache_timestamp = 0;
+long max_cache_age = 300;
+long cache_limit_mb = 1024;
+int max_cache_roots = 16;
+bool migrate_legacy_cache = false;
+int num_jobs = 0;
+size_t max_results = 0;
+bool interactive = false;
+bool use_trigram_index = false;
 std::string search_path = ".";
 std::string search_term;
 int selected_index = 0;
@@ -46,19 +323,41 @@ int max_display_items = 0;
 
 void print_usage();
 void build_cache(const std::string& path);
+void refresh_cache();
 void save_cache();
 void load_cache();
-void search_files();
+bool load_cache_file(const std::string& cache_path, const std::string& root);
+bool load_cache_v1(const std::string& cache_path, const std::string& root);
+std::string read_cache_root(const std::string& cache_path);
+void enforce_cache_limits();
+std::vector<Match> search_files(const FuzzyPattern& pattern, size_t limit, size_t& total, bool& total_exact,
+                                MatchOptions options = MatchOptions());
 void setup_ncurses();
 void cleanup_ncurses();
-void display_results(const std::vector<FileInfo>& results);
-void open_file(const std::string& path);
-int fuzzy_match_score(const std::string& str, const std::string& pattern);
+std::vector<Match> find_matches(const FuzzyPattern& pattern, size_t begin, size_t end, size_t limit, size_t& total,
+                                const MatchOptions& options = MatchOptions());
+size_t default_max_results();
+void draw_results(const std::vector<Match>& results, int max_x);
+void display_results(const std::vector<Match>& results, size_t total, bool total_exact);
+void interactive_search();
+void open_file(std::string_view path);
+int fuzzy_match_score(const FuzzyPattern& pattern, const char* str, size_t length);
+uint64_t char_mask(const char* str, size_t length);
+bool run_selftest();
 
 int main(int argc, char* argv[]) {
     static struct option long_options[] = {
         {"path", required_argument, 0, 'p'},
         {"rebuild-cache", no_argument, 0, 'r'},
+        {"refresh", no_argument, 0, 'u'},
+        {"max-age", required_argument, 0, 'a'},
+        {"cache-limit", required_argument, 0, 'L'},
+        {"max-roots", required_argument, 0, 'm'},
+        {"jobs", required_argument, 0, 'j'},
+        {"max-results", required_argument, 0, 'k'},
+        {"interactive", no_argument, 0, 'i'},
+        {"trigram-index", no_argument, 0, 't'},
+        {"selftest", no_argument, 0, 'S'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -66,7 +365,7 @@ int main(int argc, char* argv[]) {
     int opt;
     int option_index = 0;
     
-    while ((opt = getopt_long(argc, argv, "p:rh", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:rua:L:m:j:k:itSh", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'p':
                 search_path = optarg;
@@ -74,6 +373,36 @@ int main(int argc, char* argv[]) {
             case 'r':
                 rebuild_cache = true;
                 break;
+            case 'u':
+                force_refresh = true;
+                break;
+            case 'a':
+                max_cache_age = atol(optarg);
+                break;
+            case 'L':
+                cache_limit_mb = atol(optarg);
+                break;
+            case 'm':
+                max_cache_roots = std::max(1, atoi(optarg));
+                break;
+            case 'j':
+                num_jobs = atoi(optarg);
+                if (num_jobs < 1) {
+                    std::cerr << "Error: --jobs must be a positive number." << std::endl;
+                    return 1;
+                }
+                break;
+            case 'k':
+                max_results = std::max(1L, atol(optarg));
+                break;
+            case 'i':
+                interactive = true;
+                break;
+            case 't':
+                use_trigram_index = true;
+                break;
+            case 'S':
+                return run_selftest() ? 0 : 1;
             case 'h':
                 print_usage();
                 return 0;
@@ -93,6 +422,11 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    char resolved_path[PATH_MAX];
+    if (realpath(search_path.c_str(), resolved_path)) {
+        search_path = resolved_path;
+    }
+
     if (rebuild_cache) {
         build_cache(search_path);
         save_cache();
@@ -102,41 +436,50 @@ int main(int argc, char* argv[]) {
         if (file_cache.empty()) {
             build_cache(search_path);
             save_cache();
+        } else if (force_refresh || time(nullptr) - cache_timestamp > max_cache_age) {
+            refresh_cache();
+            save_cache();
+        } else if (use_trigram_index && !file_cache.has_trigram_index() && !file_cache.empty()) {
+            file_cache.build_trigram_index();
+            save_cache();
+        } else if (cache_dirty) {
+            save_cache();
         }
     }
 
-    if (!search_term.empty()) {
-        std::vector<FileInfo> results;
-        std::vector<std::pair<int, FileInfo>> scored_results;
-        
-        for (const auto& file : file_cache) {
-            int score = fuzzy_match_score(file.name, search_term);
-            if (score > 0) {
-                scored_results.push_back(std::make_pair(score, file));
-            }
-        }
-        
-        std::sort(scored_results.begin(), scored_results.end(), 
-                 [](const std::pair<int, FileInfo>& a, const std::pair<int, FileInfo>& b) {
-                     return a.first > b.first;
-                 });
-        
-        for (const auto& scored_file : scored_results) {
-            results.push_back(scored_file.second);
-        }
+    // A path the cached ancestor does not cover (new or hidden directory) gets its own root.
+    if (!file_cache.set_scope(cache_root, search_path)) {
+        build_cache(search_path);
+        save_cache();
+        file_cache.set_scope(cache_root, search_path);
+    }
+
+    if (max_results == 0) {
+        max_results = default_max_results();
+    }
+
+    if (interactive) {
+        setup_ncurses();
+        interactive_search();
+        cleanup_ncurses();
+    } else if (!search_term.empty()) {
+        FuzzyPattern pattern(search_term);
+        size_t total = 0;
+        bool total_exact = true;
+        std::vector<Match> results = search_files(pattern, max_results, total, total_exact);
         
         if (results.empty()) {
             std::cout << "No files matching '" << search_term << "' found." << std::endl;
             return 0;
         }
         
-        if (results.size() == 1) {
-            open_file(results[0].path);
+        if (total == 1 && total_exact) {
+            open_file(file_cache.path(file_cache[results[0].index]));
             return 0;
         }
         
         setup_ncurses();
-        display_results(results);
+        display_results(results, total, total_exact);
         cleanup_ncurses();
     } else {
         print_usage();
@@ -152,68 +495,684 @@ void print_usage() {
     std::cout << "Options:" << std::endl;
     std::cout << "  -p, --path=PATH        Path to search (default: current directory)" << std::endl;
     std::cout << "  -r, --rebuild-cache    Force rebuild of file cache" << std::endl;
+    std::cout << "  -u, --refresh          Refresh changed directories in the cache now" << std::endl;
+    std::cout << "  -a, --max-age=SECONDS  Refresh the cache when it is older than this (default: 300)" << std::endl;
+    std::cout << "  -L, --cache-limit=MB   Maximum total size of cached roots (default: 1024)" << std::endl;
+    std::cout << "  -m, --max-roots=N      Maximum number of cached roots (default: 16)" << std::endl;
+    std::cout << "  -j, --jobs=N           Number of threads used to build the cache and score (default: CPU count)" << std::endl;
+    std::cout << "  -k, --max-results=K    Keep only the K best matches (default: a few screens)" << std::endl;
+    std::cout << "  -i, --interactive      Search as you type, starting from SEARCH_TERM if given" << std::endl;
+    std::cout << "  -t, --trigram-index    Keep a trigram index in the cache to speed up substring queries" << std::endl;
+    std::cout << "  -S, --selftest         Check the matcher's scalar and vector code paths against the" << std::endl;
+    std::cout << "                         reference scorer on random names, and exit" << std::endl;
     std::cout << "  -h, --help             Display this help and exit" << std::endl;
     std::cout << std::endl;
     std::cout << "Alias: ff [SEARCH_TERM]" << std::endl;
 }
 
 void build_cache(const std::string& path) {
-    DIR* dir = opendir(path.c_str());
+    int jobs = num_jobs;
+    if (jobs < 1) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    file_cache.clear();
+    cache_root = path;
+    Crawler crawler(jobs);
+    crawler.crawl(path, file_cache);
+    if (use_trigram_index) {
+        file_cache.build_trigram_index();
+    }
+}
+
+// Re-reads only directories whose mtime changed since the cache was written.
+// A cache without directory records (upgraded from V1) is crawled in full.
+void refresh_cache() {
+    int jobs = num_jobs;
+    if (jobs < 1) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    FileCache fresh;
+    Crawler crawler(jobs, &file_cache);
+    crawler.crawl(cache_root, fresh);
+    file_cache = std::move(fresh);
+    if (use_trigram_index) {
+        file_cache.build_trigram_index();
+    }
+}
+
+Crawler::Crawler(int jobs, const FileCache* previous_cache) : shards(jobs), previous(previous_cache) {
+    for (int i = 0; i < jobs; ++i) {
+        queues.push_back(std::make_unique<CrawlQueue>());
+    }
+}
+
+void Crawler::crawl(const std::string& root, FileCache& out) {
+    CrawlNode root_node;
+    root_node.path = root;
+    if (previous && previous->dir_count > 0 && previous->path(previous->dirs[0]) == root) {
+        root_node.cached_dir = 0;
+    }
+    push(0, &root_node);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < queues.size(); ++i) {
+        threads.emplace_back(&Crawler::worker, this, i);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    merge(&root_node, out);
+}
+
+void Crawler::worker(size_t id) {
+    while (true) {
+        CrawlNode* node = next_task(id);
+        if (!node) {
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            sleeping.fetch_add(1);
+            idle.wait(lock, [&] { return pending.load() == 0 || queued.load() > 0; });
+            sleeping.fetch_sub(1);
+            if (pending.load() == 0) {
+                return;
+            }
+            continue;
+        }
+        scan(id, node);
+        if (pending.fetch_sub(1) == 1) {
+            wake(true);
+        }
+    }
+}
+
+void Crawler::push(size_t id, CrawlNode* node) {
+    pending.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(queues[id]->mutex);
+        queues[id]->tasks.push_back(node);
+        queued.fetch_add(1);
+    }
+    wake(false);
+}
+
+// Sleepers re-check queued and pending under idle_mutex, so taking it
+// before notifying cannot miss one that is about to wait.
+void Crawler::wake(bool all) {
+    if (sleeping.load() == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    if (all) {
+        idle.notify_all();
+    } else {
+        idle.notify_one();
+    }
+}
+
+CrawlNode* Crawler::next_task(size_t id) {
+    {
+        std::lock_guard<std::mutex> lock(queues[id]->mutex);
+        if (!queues[id]->tasks.empty()) {
+            CrawlNode* node = queues[id]->tasks.back();
+            queues[id]->tasks.pop_back();
+            queued.fetch_sub(1);
+            return node;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+        CrawlQueue& victim = *queues[(id + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            CrawlNode* node = victim.tasks.front();
+            victim.tasks.pop_front();
+            queued.fetch_sub(1);
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+CrawlNode* Crawler::add_child(size_t id, CrawlNode* node, std::string path, int64_t cached_dir) {
+    shards[id].emplace_back();
+    CrawlNode* child = &shards[id].back();
+    child->path = std::move(path);
+    child->cached_dir = cached_dir;
+    node->subdirs.emplace_back(node->files.size(), child);
+    push(id, child);
+    return child;
+}
+
+// Copies an unchanged directory's own files from the previous cache and queues
+// its subdirectories for the same check.
+bool Crawler::reuse(size_t id, CrawlNode* node) {
+    const DirInfo& dir = previous->dirs[node->cached_dir];
+    struct stat st;
+    if (stat(node->path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_mtim.tv_sec != dir.mtime_sec || st.st_mtim.tv_nsec != dir.mtime_nsec) {
+        return false;
+    }
+    node->mtime = st.st_mtim;
+
+    auto copy_files = [&](uint64_t from, uint64_t to) {
+        for (uint64_t i = from; i < to; ++i) {
+            const FileInfo& file = previous->entries[i];
+            node->files.push_back({std::string(previous->path(file)), file.name_length,
+                                   static_cast<time_t>(file.modified_time)});
+        }
+    };
+
+    uint64_t next_file = dir.first_file;
+    uint64_t child = node->cached_dir + 1;
+    uint64_t subtree_end = node->cached_dir + 1 + dir.subtree_dirs;
+    while (child < subtree_end) {
+        const DirInfo& child_dir = previous->dirs[child];
+        copy_files(next_file, child_dir.first_file);
+        add_child(id, node, std::string(previous->path(child_dir)), child);
+        next_file = child_dir.first_file + child_dir.subtree_files;
+        child += child_dir.subtree_dirs + 1;
+    }
+    copy_files(next_file, dir.first_file + dir.subtree_files);
+    return true;
+}
+
+void Crawler::scan(size_t id, CrawlNode* node) {
+    if (node->cached_dir >= 0 && reuse(id, node)) {
+        return;
+    }
+
+    DIR* dir = opendir(node->path.c_str());
     if (!dir) {
         return;
     }
+    int dir_fd = dirfd(dir);
+
+    // Taken before reading so changes made during the scan are seen next refresh.
+    struct stat dir_st;
+    if (fstat(dir_fd, &dir_st) == 0) {
+        node->mtime = dir_st.st_mtim;
+    }
+
+    // Subdirectories already in the previous cache keep their records so
+    // their own unchanged contents can still be reused.
+    std::unordered_map<std::string_view, int64_t> cached_children;
+    if (node->cached_dir >= 0) {
+        const DirInfo& cached = previous->dirs[node->cached_dir];
+        uint64_t end = node->cached_dir + 1 + cached.subtree_dirs;
+        for (uint64_t child = node->cached_dir + 1; child < end; child += previous->dirs[child].subtree_dirs + 1) {
+            std::string_view child_path = previous->path(previous->dirs[child]);
+            cached_children[child_path.substr(child_path.rfind('/') + 1)] = child;
+        }
+    }
 
     struct dirent* entry;
     while ((entry = readdir(dir)) != nullptr) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
-        
-        std::string name = entry->d_name;
-        std::string full_path = path + "/" + name;
-        
+
+        // d_type lets us skip stat() for directories; files still need it for mtime.
+        unsigned char type = entry->d_type;
         struct stat st;
-        if (stat(full_path.c_str(), &st) != 0) {
-            continue;
+        bool have_stat = false;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (fstatat(dir_fd, entry->d_name, &st, 0) != 0) {
+                continue;
+            }
+            have_stat = true;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
         }
-        
-        if (S_ISDIR(st.st_mode)) {
-            if (name[0] == '.') {
+
+        if (type == DT_DIR) {
+            if (entry->d_name[0] == '.') {
                 continue;
             }
-            
-            build_cache(full_path);
-        } else if (S_ISREG(st.st_mode)) {
-            file_cache.emplace_back(full_path, name, st.st_mtime);
+
+            auto cached = cached_children.find(entry->d_name);
+            add_child(id, node, join_path(node->path, entry->d_name),
+                      cached != cached_children.end() ? cached->second : -1);
+        } else if (type == DT_REG) {
+            if (!have_stat && fstatat(dir_fd, entry->d_name, &st, 0) != 0) {
+                continue;
+            }
+            node->files.push_back({join_path(node->path, entry->d_name),
+                                   static_cast<uint32_t>(strlen(entry->d_name)), st.st_mtime});
         }
     }
-    
+
     closedir(dir);
 }
 
+void Crawler::merge(CrawlNode* node, FileCache& out) {
+    size_t dir_index = out.add_dir(node->path, node->mtime);
+    size_t next = 0;
+    for (const auto& subdir : node->subdirs) {
+        for (; next < subdir.first; ++next) {
+            const CrawlFile& file = node->files[next];
+            out.add(file.path, file.name_length, file.modified_time);
+        }
+        merge(subdir.second, out);
+    }
+    for (; next < node->files.size(); ++next) {
+        const CrawlFile& file = node->files[next];
+        out.add(file.path, file.name_length, file.modified_time);
+    }
+    node->files.clear();
+    node->files.shrink_to_fit();
+    out.close_dir(dir_index);
+}
+
+FileCache::~FileCache() {
+    clear();
+}
+
+FileCache& FileCache::operator=(FileCache&& other) {
+    if (this == &other) {
+        return *this;
+    }
+    clear();
+    owned_entries = std::move(other.owned_entries);
+    owned_dirs = std::move(other.owned_dirs);
+    owned_pool = std::move(other.owned_pool);
+    owned_keys = std::move(other.owned_keys);
+    owned_lower_pool = std::move(other.owned_lower_pool);
+    owned_trigrams = std::move(other.owned_trigrams);
+    owned_postings = std::move(other.owned_postings);
+    mapping = other.mapping;
+    mapping_size = other.mapping_size;
+    entries = other.entries;
+    count = other.count;
+    dirs = other.dirs;
+    dir_count = other.dir_count;
+    pool = other.pool;
+    pool_size = other.pool_size;
+    keys = other.keys;
+    lower_pool = other.lower_pool;
+    lower_pool_size = other.lower_pool_size;
+    trigrams = other.trigrams;
+    trigram_count = other.trigram_count;
+    postings = other.postings;
+    posting_count = other.posting_count;
+    other.mapping = nullptr;
+    other.clear();
+    if (!mapping) {
+        update_pointers();
+    }
+    return *this;
+}
+
+void FileCache::clear() {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+    owned_entries.clear();
+    owned_dirs.clear();
+    owned_pool.clear();
+    owned_keys.clear();
+    owned_lower_pool.clear();
+    owned_trigrams.clear();
+    owned_postings.clear();
+    entries = nullptr;
+    count = 0;
+    dirs = nullptr;
+    dir_count = 0;
+    pool = nullptr;
+    pool_size = 0;
+    keys = nullptr;
+    lower_pool = nullptr;
+    lower_pool_size = 0;
+    trigrams = nullptr;
+    trigram_count = 0;
+    postings = nullptr;
+    posting_count = 0;
+    scope_begin = 0;
+    scope_end = 0;
+}
+
+void FileCache::update_pointers() {
+    entries = owned_entries.data();
+    count = owned_entries.size();
+    dirs = owned_dirs.data();
+    dir_count = owned_dirs.size();
+    pool = owned_pool.data();
+    pool_size = owned_pool.size();
+    keys = owned_keys.data();
+    lower_pool = owned_lower_pool.data();
+    lower_pool_size = owned_lower_pool.size();
+    trigrams = owned_trigrams.data();
+    trigram_count = owned_trigrams.size();
+    postings = owned_postings.data();
+    posting_count = owned_postings.size();
+}
+
+void FileCache::add(std::string_view path, size_t name_length, time_t mtime) {
+    owned_entries.push_back({owned_pool.size(), static_cast<uint32_t>(path.size()),
+                             static_cast<uint32_t>(name_length), static_cast<int64_t>(mtime)});
+    owned_pool.append(path);
+
+    size_t lower_offset = owned_lower_pool.empty() ? 0 : owned_lower_pool.size() - LOWER_POOL_PADDING;
+    owned_lower_pool.resize(lower_offset);
+    for (char c : path.substr(path.size() - name_length)) {
+        owned_lower_pool.push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+    }
+    owned_keys.push_back({char_mask(owned_lower_pool.data() + lower_offset, name_length),
+                          static_cast<uint32_t>(lower_offset), static_cast<uint32_t>(name_length)});
+    owned_lower_pool.append(LOWER_POOL_PADDING, '\0');
+    update_pointers();
+}
+
+size_t FileCache::add_dir(std::string_view path, const struct timespec& mtime) {
+    owned_dirs.push_back({owned_pool.size(), static_cast<uint32_t>(path.size()), 0,
+                          owned_entries.size(), 0, mtime.tv_sec, mtime.tv_nsec});
+    owned_pool.append(path);
+    update_pointers();
+    return owned_dirs.size() - 1;
+}
+
+void FileCache::close_dir(size_t index) {
+    DirInfo& dir = owned_dirs[index];
+    dir.subtree_dirs = static_cast<uint32_t>(owned_dirs.size() - index - 1);
+    dir.subtree_files = owned_entries.size() - dir.first_file;
+}
+
+// Two passes over the lowercase names: count each trigram's files, then fill the
+// posting lists in file order so every list comes out sorted. A name's repeated
+// trigrams are only posted once.
+void FileCache::build_trigram_index() {
+    std::vector<uint32_t> counts(1 << 24, 0);
+    std::vector<uint32_t> name_trigrams;
+    auto collect = [&](size_t i) {
+        const unsigned char* name = reinterpret_cast<const unsigned char*>(lower_name(i));
+        name_trigrams.clear();
+        for (size_t j = 0; j + 3 <= keys[i].length; ++j) {
+            name_trigrams.push_back((name[j] << 16) | (name[j + 1] << 8) | name[j + 2]);
+        }
+        std::sort(name_trigrams.begin(), name_trigrams.end());
+        name_trigrams.erase(std::unique(name_trigrams.begin(), name_trigrams.end()), name_trigrams.end());
+    };
+
+    for (size_t i = 0; i < count; ++i) {
+        collect(i);
+        for (uint32_t trigram : name_trigrams) {
+            counts[trigram]++;
+        }
+    }
+
+    owned_trigrams.clear();
+    uint64_t offset = 0;
+    for (uint32_t trigram = 0; trigram < counts.size(); ++trigram) {
+        if (counts[trigram] > 0) {
+            owned_trigrams.push_back({trigram, counts[trigram], offset});
+            offset += counts[trigram];
+            counts[trigram] = static_cast<uint32_t>(owned_trigrams.size() - 1);
+        }
+    }
+
+    owned_postings.assign(offset, 0);
+    std::vector<uint64_t> cursors(owned_trigrams.size());
+    for (size_t t = 0; t < owned_trigrams.size(); ++t) {
+        cursors[t] = owned_trigrams[t].offset;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        collect(i);
+        for (uint32_t trigram : name_trigrams) {
+            owned_postings[cursors[counts[trigram]]++] = static_cast<uint32_t>(i);
+        }
+    }
+
+    trigrams = owned_trigrams.data();
+    trigram_count = owned_trigrams.size();
+    postings = owned_postings.data();
+    posting_count = owned_postings.size();
+}
+
+// File indices in [begin, end) whose lowercase name contains every trigram of
+// lower, ascending. The shortest posting list is intersected with the others.
+void FileCache::trigram_candidates(const std::string& lower, size_t begin, size_t end,
+                                   std::vector<size_t>& out) const {
+    out.clear();
+    std::vector<const TrigramEntry*> lists;
+    for (size_t j = 0; j + 3 <= lower.size(); ++j) {
+        uint32_t trigram = (static_cast<unsigned char>(lower[j]) << 16) |
+                           (static_cast<unsigned char>(lower[j + 1]) << 8) |
+                           static_cast<unsigned char>(lower[j + 2]);
+        const TrigramEntry* found = std::lower_bound(trigrams, trigrams + trigram_count, trigram,
+            [](const TrigramEntry& entry, uint32_t value) { return entry.trigram < value; });
+        if (found == trigrams + trigram_count || found->trigram != trigram) {
+            return;
+        }
+        lists.push_back(found);
+    }
+    std::sort(lists.begin(), lists.end(), [](const TrigramEntry* a, const TrigramEntry* b) {
+        return a->count < b->count;
+    });
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+
+    const uint32_t* first = postings + lists[0]->offset;
+    const uint32_t* first_end = first + lists[0]->count;
+    for (const uint32_t* it = std::lower_bound(first, first_end, begin); it != first_end && *it < end; ++it) {
+        out.push_back(*it);
+    }
+    for (size_t l = 1; l < lists.size() && !out.empty(); ++l) {
+        const uint32_t* list = postings + lists[l]->offset;
+        const uint32_t* list_end = list + lists[l]->count;
+        size_t kept = 0;
+        for (size_t candidate : out) {
+            list = std::lower_bound(list, list_end, candidate);
+            if (list == list_end) {
+                break;
+            }
+            if (*list == candidate) {
+                out[kept++] = candidate;
+            }
+        }
+        out.resize(kept);
+    }
+}
+
+// Limits searches to the files below dir, which must be root or a directory cached under it.
+bool FileCache::set_scope(std::string_view root, std::string_view dir) {
+    if (dir == root) {
+        scope_begin = 0;
+        scope_end = count;
+        return true;
+    }
+    size_t i = find_dir(dir);
+    if (i == dir_count) {
+        return false;
+    }
+    scope_begin = dirs[i].first_file;
+    scope_end = dirs[i].first_file + dirs[i].subtree_files;
+    return true;
+}
+
+// The index of dir in the directory table, or dir_count if it was not crawled.
+size_t FileCache::find_dir(std::string_view dir) const {
+    for (size_t i = 0; i < dir_count; ++i) {
+        if (path(dirs[i]) == dir) {
+            return i;
+        }
+    }
+    return dir_count;
+}
+
 void save_cache() {
-    std::ofstream cache_file(get_cache_file_path());
+    mkdir(get_cache_dir().c_str(), 0700);
+    std::string cache_path = get_cache_file_path(cache_root);
+    std::string tmp_path = cache_path + ".tmp" + std::to_string(getpid());
+    std::ofstream cache_file(tmp_path, std::ios::binary | std::ios::trunc);
     if (!cache_file.is_open()) {
         std::cerr << "Warning: Could not open cache file for writing." << std::endl;
         return;
     }
-    
-    time_t now = time(nullptr);
-    cache_file << "FILESEARCH_CACHE_V1" << std::endl;
-    cache_file << now << std::endl;
-    cache_file << search_path << std::endl;
-    
-    for (const auto& file : file_cache) {
-        cache_file << file.path << "\t" << file.name << "\t" << file.modified_time << std::endl;
-    }
-    
+
+    // Layout: header, root path, entry table (8-byte aligned), directory table,
+    // name key table, trigram table, postings, string pool, lowercase name pool.
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC_V2, sizeof(CACHE_MAGIC_V2));
+    header.byte_order = CACHE_BYTE_ORDER;
+    header.header_size = sizeof(CacheHeader);
+    header.entry_size = sizeof(FileInfo);
+    header.timestamp = time(nullptr);
+    header.root_offset = sizeof(CacheHeader);
+    header.root_length = cache_root.size();
+    header.entry_count = file_cache.size();
+    header.entries_offset = (header.root_offset + header.root_length + 7) & ~uint64_t(7);
+    header.dir_count = file_cache.dir_count;
+    header.dirs_offset = header.entries_offset + file_cache.size() * sizeof(FileInfo);
+    header.keys_offset = header.dirs_offset + file_cache.dir_count * sizeof(DirInfo);
+    header.trigram_count = file_cache.trigram_count;
+    header.trigrams_offset = header.keys_offset + file_cache.size() * sizeof(NameKey);
+    header.posting_count = file_cache.posting_count;
+    header.postings_offset = header.trigrams_offset + file_cache.trigram_count * sizeof(TrigramEntry);
+    header.pool_offset = header.postings_offset + file_cache.posting_count * sizeof(uint32_t);
+    header.pool_size = file_cache.pool_size;
+    header.lower_pool_offset = header.pool_offset + header.pool_size;
+    header.lower_pool_size = file_cache.lower_pool_size;
+
+    static const char padding[8] = {0};
+    cache_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    cache_file.write(cache_root.data(), cache_root.size());
+    cache_file.write(padding, header.entries_offset - header.root_offset - header.root_length);
+    cache_file.write(reinterpret_cast<const char*>(file_cache.entries), file_cache.size() * sizeof(FileInfo));
+    cache_file.write(reinterpret_cast<const char*>(file_cache.dirs), file_cache.dir_count * sizeof(DirInfo));
+    cache_file.write(reinterpret_cast<const char*>(file_cache.keys), file_cache.size() * sizeof(NameKey));
+    cache_file.write(reinterpret_cast<const char*>(file_cache.trigrams), file_cache.trigram_count * sizeof(TrigramEntry));
+    cache_file.write(reinterpret_cast<const char*>(file_cache.postings), file_cache.posting_count * sizeof(uint32_t));
+    cache_file.write(file_cache.pool, file_cache.pool_size);
+    cache_file.write(file_cache.lower_pool, file_cache.lower_pool_size);
     cache_file.close();
+
+    if (cache_file.fail() || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        std::cerr << "Warning: Could not write cache file." << std::endl;
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    if (migrate_legacy_cache) {
+        unlink(get_legacy_cache_path().c_str());
+        migrate_legacy_cache = false;
+    }
+    enforce_cache_limits();
 }
 
+// Uses the cache of search_path itself or of its closest cached ancestor,
+// then falls back to the single-root cache file of older versions.
 void load_cache() {
-    std::ifstream cache_file(get_cache_file_path());
+    std::string root = search_path;
+    while (true) {
+        std::string cache_path = get_cache_file_path(root);
+        if (load_cache_file(cache_path, root)) {
+            cache_root = root;
+            utimensat(AT_FDCWD, cache_path.c_str(), nullptr, 0);
+            return;
+        }
+        if (root == "/") {
+            break;
+        }
+        size_t slash = root.rfind('/');
+        root = slash == 0 ? "/" : root.substr(0, slash);
+    }
+
+    if (load_cache_file(get_legacy_cache_path(), search_path)) {
+        cache_root = search_path;
+        cache_dirty = true;
+        migrate_legacy_cache = true;
+    }
+}
+
+bool load_cache_file(const std::string& cache_path, const std::string& root) {
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    char magic[sizeof(CACHE_MAGIC_V2)] = {0};
+    if (fstat(fd, &st) != 0 || read(fd, magic, sizeof(magic) - 1) != sizeof(magic) - 1) {
+        close(fd);
+        return false;
+    }
+    if (strcmp(magic, CACHE_MAGIC_V1) == 0) {
+        close(fd);
+        return load_cache_v1(cache_path, root);
+    }
+
+    size_t file_size = st.st_size;
+    if (strcmp(magic, CACHE_MAGIC_V2) != 0 || file_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    const char* base = static_cast<const char*>(mapping);
+    const CacheHeader* header = reinterpret_cast<const CacheHeader*>(base);
+    bool valid = header->byte_order == CACHE_BYTE_ORDER &&
+                 header->header_size == sizeof(CacheHeader) &&
+                 header->entry_size == sizeof(FileInfo) &&
+                 header->root_offset + header->root_length <= file_size &&
+                 header->entries_offset % alignof(FileInfo) == 0 &&
+                 header->entry_count <= (file_size - std::min<uint64_t>(header->entries_offset, file_size)) / sizeof(FileInfo) &&
+                 header->dir_count <= file_size / sizeof(DirInfo) &&
+                 header->pool_offset + header->pool_size <= file_size &&
+                 header->entries_offset + header->entry_count * sizeof(FileInfo) <= header->dirs_offset &&
+                 header->dirs_offset + header->dir_count * sizeof(DirInfo) <= header->keys_offset &&
+                 header->trigram_count <= file_size / sizeof(TrigramEntry) &&
+                 header->posting_count <= file_size / sizeof(uint32_t) &&
+                 header->keys_offset + header->entry_count * sizeof(NameKey) <= header->trigrams_offset &&
+                 header->trigrams_offset + header->trigram_count * sizeof(TrigramEntry) <= header->postings_offset &&
+                 header->postings_offset + header->posting_count * sizeof(uint32_t) <= header->pool_offset &&
+                 header->lower_pool_offset + header->lower_pool_size <= file_size &&
+                 (header->entry_count == 0 || header->lower_pool_size >= LOWER_POOL_PADDING);
+    if (!valid) {
+        munmap(mapping, file_size);
+        return false;
+    }
+
+    std::string_view cached_path(base + header->root_offset, header->root_length);
+    if (cached_path != root) {
+        munmap(mapping, file_size);
+        return false;
+    }
+
+    file_cache.clear();
+    cache_timestamp = header->timestamp;
+    file_cache.mapping = mapping;
+    file_cache.mapping_size = file_size;
+    file_cache.entries = reinterpret_cast<const FileInfo*>(base + header->entries_offset);
+    file_cache.count = header->entry_count;
+    file_cache.dirs = reinterpret_cast<const DirInfo*>(base + header->dirs_offset);
+    file_cache.dir_count = header->dir_count;
+    file_cache.pool = base + header->pool_offset;
+    file_cache.pool_size = header->pool_size;
+    file_cache.keys = reinterpret_cast<const NameKey*>(base + header->keys_offset);
+    file_cache.lower_pool = base + header->lower_pool_offset;
+    file_cache.lower_pool_size = header->lower_pool_size;
+    file_cache.trigrams = reinterpret_cast<const TrigramEntry*>(base + header->trigrams_offset);
+    file_cache.trigram_count = header->trigram_count;
+    file_cache.postings = reinterpret_cast<const uint32_t*>(base + header->postings_offset);
+    file_cache.posting_count = header->posting_count;
+    if (file_cache.has_trigram_index()) {
+        use_trigram_index = true;
+    }
+    return true;
+}
+
+// Reads the old text cache; it is written back in the V2 format by main().
+// V1 stored the --path argument as given (usually "."), so the stored root
+// is resolved before comparing and its entries are rebased onto the result.
+bool load_cache_v1(const std::string& cache_path, const std::string& root) {
+    std::ifstream cache_file(cache_path);
     if (!cache_file.is_open()) {
-        return;
+        return false;
     }
     
     std::string version;
@@ -221,42 +1180,299 @@ void load_cache() {
     std::string cached_path;
     
     std::getline(cache_file, version);
-    if (version != "FILESEARCH_CACHE_V1") {
+    if (version != CACHE_MAGIC_V1) {
         cache_file.close();
-        return;
+        return false;
     }
     
     cache_file >> timestamp >> std::ws;
     std::getline(cache_file, cached_path);
     
-    if (cached_path != search_path) {
+    char resolved_path[PATH_MAX];
+    std::string cached_root = realpath(cached_path.c_str(), resolved_path) ? resolved_path : cached_path;
+    if (cached_root != root) {
         cache_file.close();
-        rebuild_cache = true;
-        return;
-    }
-    
-    time_t now = time(nullptr);
-    if (now - timestamp > 86400) {
-        cache_file.close();
-        rebuild_cache = true;
-        return;
+        return false;
     }
     
     file_cache.clear();
+    cache_timestamp = timestamp;
+    cache_dirty = true;
     std::string line;
     while (std::getline(cache_file, line)) {
-        std::istringstream iss(line);
-        std::string path, name;
-        time_t mtime;
-        
-        std::getline(iss, path, '\t');
-        std::getline(iss, name, '\t');
-        iss >> mtime;
+        size_t path_end = line.find('\t');
+        size_t name_end = line.find('\t', path_end + 1);
+        if (path_end == std::string::npos || name_end == std::string::npos) {
+            continue;
+        }
         
-        file_cache.emplace_back(path, name, mtime);
+        std::string_view path(line.data(), path_end);
+        time_t mtime = strtoll(line.c_str() + name_end + 1, nullptr, 10);
+        if (cached_root != cached_path && path.compare(0, cached_path.size(), cached_path) == 0) {
+            std::string rebased = cached_root;
+            rebased.append(path.substr(cached_path.size()));
+            file_cache.add(rebased, name_end - path_end - 1, mtime);
+            continue;
+        }
+        file_cache.add(path, name_end - path_end - 1, mtime);
     }
     
     cache_file.close();
+    return true;
+}
+
+std::string read_cache_root(const std::string& cache_path) {
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return "";
+    }
+    CacheHeader header;
+    std::string root;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        strcmp(header.magic, CACHE_MAGIC_V2) == 0 && header.root_length < PATH_MAX) {
+        root.resize(header.root_length);
+        if (pread(fd, &root[0], root.size(), header.root_offset) != static_cast<ssize_t>(root.size())) {
+            root.clear();
+        }
+    }
+    close(fd);
+    return root;
+}
+
+// Evicts the least recently used roots until the store fits --cache-limit and
+// --max-roots. Roots below the current one are dropped if its directory table
+// has them; hidden directories, which the crawl skips, keep their own cache.
+void enforce_cache_limits() {
+    struct StoreEntry {
+        std::string path;
+        off_t size;
+        time_t last_used;
+    };
+
+    std::string cache_dir = get_cache_dir();
+    std::string current = get_cache_file_path(cache_root);
+    std::string nested_prefix = cache_root == "/" ? cache_root : cache_root + "/";
+    DIR* dir = opendir(cache_dir.c_str());
+    if (!dir) {
+        return;
+    }
+
+    std::vector<StoreEntry> store;
+    off_t total_size = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.size() <= 6 || name.compare(name.size() - 6, 6, ".cache") != 0) {
+            continue;
+        }
+        std::string path = cache_dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        if (path == current) {
+            total_size += st.st_size;
+            continue;
+        }
+        std::string root = read_cache_root(path);
+        if (root.compare(0, nested_prefix.size(), nested_prefix) == 0 &&
+            file_cache.find_dir(root) < file_cache.dir_count) {
+            unlink(path.c_str());
+            continue;
+        }
+        store.push_back({path, st.st_size, st.st_mtime});
+    }
+    closedir(dir);
+
+    std::sort(store.begin(), store.end(), [](const StoreEntry& a, const StoreEntry& b) {
+        return a.last_used > b.last_used;
+    });
+
+    off_t limit = static_cast<off_t>(cache_limit_mb) * 1024 * 1024;
+    int kept = 1;
+    for (const auto& cached : store) {
+        if (kept + 1 > max_cache_roots || total_size + cached.size > limit) {
+            unlink(cached.path.c_str());
+            continue;
+        }
+        total_size += cached.size;
+        kept++;
+    }
+}
+
+// Best first; ties keep cache order so results do not depend on the thread split.
+bool better_match(const Match& a, const Match& b) {
+    return a.score > b.score || (a.score == b.score && a.index < b.index);
+}
+
+// Scores file_cache[begin, end) in chunks on up to --jobs threads. Each thread
+// keeps a heap of its `limit` best matches (worst on top); the heaps are merged
+// at the end. total receives the number of matches before the cut.
+std::vector<Match> find_matches(const FuzzyPattern& pattern, size_t begin, size_t end, size_t limit, size_t& total,
+                                const MatchOptions& options) {
+    const size_t min_chunk = 16384;
+    size_t jobs = num_jobs > 0 ? num_jobs : std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::max<size_t>(1, std::min(jobs, (end - begin + min_chunk - 1) / min_chunk));
+
+    std::vector<std::vector<Match>> heaps(jobs);
+    std::vector<std::vector<size_t>> matched(options.matched ? jobs : 0);
+    std::vector<size_t> counts(jobs, 0);
+    auto score_chunk = [&](size_t job) {
+        size_t chunk_begin = begin + (end - begin) * job / jobs;
+        size_t chunk_end = begin + (end - begin) * (job + 1) / jobs;
+        std::vector<Match>& heap = heaps[job];
+        heap.reserve(limit);
+        if (options.seed) {
+            heap.assign(options.seed->begin(), options.seed->end());
+            std::make_heap(heap.begin(), heap.end(), better_match);
+        }
+        const size_t* skip = nullptr;
+        const size_t* skip_end = nullptr;
+        if (options.skip) {
+            skip_end = options.skip->data() + options.skip->size();
+            skip = std::lower_bound(options.skip->data(), skip_end, chunk_begin);
+        }
+        for (size_t pos = chunk_begin; pos < chunk_end; ++pos) {
+            if (options.cancelled && (pos & 4095) == 0 && options.cancelled->load(std::memory_order_relaxed)) {
+                return;
+            }
+            size_t i = options.candidates ? (*options.candidates)[pos] : pos;
+            if (skip != skip_end && *skip == i) {
+                skip++;
+                continue;
+            }
+            if (heap.size() == limit && (heap.front().score > options.max_score ||
+                                         (heap.front().score == options.max_score && heap.front().index < i))) {
+                options.stopped_early->store(true, std::memory_order_relaxed);
+                return;
+            }
+            const NameKey& key = file_cache.keys[i];
+            if (pattern.char_mask & ~key.char_mask) {
+                continue;
+            }
+            int score = fuzzy_match_score(pattern, file_cache.lower_name(i), key.length);
+            if (score <= 0) {
+                continue;
+            }
+            counts[job]++;
+            if (options.matched) {
+                matched[job].push_back(i);
+            }
+            Match match = {score, i};
+            if (heap.size() < limit) {
+                heap.push_back(match);
+                std::push_heap(heap.begin(), heap.end(), better_match);
+            } else if (better_match(match, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), better_match);
+                heap.back() = match;
+                std::push_heap(heap.begin(), heap.end(), better_match);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t job = 1; job < jobs; ++job) {
+        threads.emplace_back(score_chunk, job);
+    }
+    score_chunk(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::vector<Match> results;
+    total = 0;
+    if (options.cancelled && options.cancelled->load()) {
+        return results;
+    }
+    if (options.matched) {
+        options.matched->clear();
+    }
+    for (size_t job = 0; job < jobs; ++job) {
+        total += counts[job];
+        results.insert(results.end(), heaps[job].begin(), heaps[job].end());
+        if (options.matched) {
+            options.matched->insert(options.matched->end(), matched[job].begin(), matched[job].end());
+        }
+    }
+    std::sort(results.begin(), results.end(), better_match);
+    if (options.seed && jobs > 1) {
+        results.erase(std::unique(results.begin(), results.end(), [](const Match& a, const Match& b) {
+            return a.index == b.index;
+        }), results.end());
+    }
+    if (results.size() > limit) {
+        results.resize(limit);
+    }
+    return results;
+}
+
+// Scores the searched scope. With a trigram index and a query of 3+ bytes,
+// names containing all of its trigrams are scored first; they include every
+// substring match. The rest can only match as a subsequence with at least one
+// gap, which caps their score. If the K-th best candidate beats that cap the
+// answer is final and total only counts candidates. Otherwise the other names
+// are scanned to fill the remaining places, starting from the candidates'
+// best and stopping wherever nothing left can beat them. Both shortcuts leave
+// total inexact, so they are only taken when the candidates alone outnumber
+// limit; a total that may fit in limit (a single match opens directly) and
+// interactive narrowing, which needs every match, get the full scan.
+std::vector<Match> search_files(const FuzzyPattern& pattern, size_t limit, size_t& total, bool& total_exact,
+                                MatchOptions options) {
+    total_exact = true;
+    size_t m = pattern.lower.size();
+    if (!file_cache.has_trigram_index() || m < 3 || options.candidates) {
+        size_t begin = options.candidates ? 0 : file_cache.scope_begin;
+        size_t end = options.candidates ? options.candidates->size() : file_cache.scope_end;
+        return find_matches(pattern, begin, end, limit, total, options);
+    }
+
+    std::vector<size_t> candidates;
+    std::vector<size_t> candidates_matched;
+    file_cache.trigram_candidates(pattern.lower, file_cache.scope_begin, file_cache.scope_end, candidates);
+    MatchOptions indexed = options;
+    indexed.candidates = &candidates;
+    indexed.matched = options.matched ? &candidates_matched : nullptr;
+    size_t candidates_total = 0;
+    std::vector<Match> seed = find_matches(pattern, 0, candidates.size(), limit, candidates_total, indexed);
+    if (options.cancelled && options.cancelled->load()) {
+        return seed;
+    }
+    int max_gapped_score = static_cast<int>(10 * m + 5 * ((m - 1) * m / 2 + 1));
+    bool cut_short = !options.matched && candidates_total > limit;
+    if (cut_short && seed.back().score > max_gapped_score) {
+        total = candidates_total;
+        total_exact = false;
+        return seed;
+    }
+
+    std::atomic<bool> stopped_early{false};
+    MatchOptions rest = options;
+    rest.skip = &candidates;
+    rest.seed = &seed;
+    rest.stopped_early = &stopped_early;
+    if (cut_short) {
+        rest.max_score = max_gapped_score;
+    }
+    std::vector<Match> results = find_matches(pattern, file_cache.scope_begin, file_cache.scope_end, limit, total, rest);
+    total += candidates_total;
+    total_exact = !stopped_early.load();
+    if (options.matched) {
+        std::vector<size_t> merged;
+        merged.reserve(options.matched->size() + candidates_matched.size());
+        std::merge(options.matched->begin(), options.matched->end(), candidates_matched.begin(),
+                   candidates_matched.end(), std::back_inserter(merged));
+        options.matched->swap(merged);
+    }
+    return results;
+}
+
+size_t default_max_results() {
+    struct winsize ws;
+    size_t rows = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+        rows = ws.ws_row;
+    }
+    return rows * 5;
 }
 
 void setup_ncurses() {
@@ -279,7 +1495,7 @@ void cleanup_ncurses() {
     endwin();
 }
 
-void display_results(const std::vector<FileInfo>& results) {
+void display_results(const std::vector<Match>& results, size_t total, bool total_exact) {
     int max_y, max_x;
     getmaxyx(stdscr, max_y, max_x);
     
@@ -290,38 +1506,16 @@ void display_results(const std::vector<FileInfo>& results) {
         attron(A_BOLD);
         mvprintw(0, 0, "FileSearch: %s", search_term.c_str());
         attroff(A_BOLD);
-        mvprintw(1, 0, "Found %zu files. Use arrow keys to navigate, Enter to open, q to quit.", results.size());
+        if (total > results.size() || !total_exact) {
+            mvprintw(1, 0, "Found %zu%s files, showing best %zu. Use arrow keys to navigate, Enter to open, q to quit.",
+                     total, total_exact ? "" : "+", results.size());
+        } else {
+            mvprintw(1, 0, "Found %zu files. Use arrow keys to navigate, Enter to open, q to quit.", results.size());
+        }
         
         mvhline(2, 0, ACS_HLINE, max_x);
         
-        int display_count = std::min(max_display_items, static_cast<int>(results.size()));
-        
-        if (selected_index < scroll_offset) {
-            scroll_offset = selected_index;
-        } else if (selected_index >= scroll_offset + display_count) {
-            scroll_offset = selected_index - display_count + 1;
-        }
-        
-        for (int i = 0; i < display_count; ++i) {
-            int index = i + scroll_offset;
-            if (index >= static_cast<int>(results.size())) {
-                break;
-            }
-            
-            const FileInfo& file = results[index];
-            
-            if (index == selected_index) {
-                attron(COLOR_PAIR(1) | A_BOLD);
-                mvprintw(i + 3, 0, "> %s", file.name.c_str());
-                attroff(COLOR_PAIR(1) | A_BOLD);
-                
-                attron(COLOR_PAIR(2));
-                mvprintw(i + 3, max_x - 30, "%s", file.path.substr(0, 30).c_str());
-                attroff(COLOR_PAIR(2));
-            } else {
-                mvprintw(i + 3, 2, "%s", file.name.c_str());
-            }
-        }
+        draw_results(results, max_x);
         
         mvhline(max_y - 1, 0, ACS_HLINE, max_x);
         mvprintw(max_y - 1, 0, "Press 'q' to quit");
@@ -343,7 +1537,7 @@ void display_results(const std::vector<FileInfo>& results) {
             case '\n':  
                 if (!results.empty()) {
                     cleanup_ncurses();
-                    open_file(results[selected_index].path);
+                    open_file(file_cache.path(file_cache[results[selected_index].index]));
                     return;
                 }
                 break;
@@ -355,38 +1549,432 @@ void display_results(const std::vector<FileInfo>& results) {
     }
 }
 
-void open_file(const std::string& path) {
+void draw_results(const std::vector<Match>& results, int max_x) {
+    int display_count = std::min(max_display_items, static_cast<int>(results.size()));
+    
+    if (selected_index < scroll_offset) {
+        scroll_offset = selected_index;
+    } else if (selected_index >= scroll_offset + display_count) {
+        scroll_offset = selected_index - display_count + 1;
+    }
+    
+    for (int i = 0; i < display_count; ++i) {
+        int index = i + scroll_offset;
+        if (index >= static_cast<int>(results.size())) {
+            break;
+        }
+        
+        const FileInfo& file = file_cache[results[index].index];
+        std::string_view name = file_cache.name(file);
+        std::string_view path = file_cache.path(file).substr(0, 30);
+        
+        if (index == selected_index) {
+            attron(COLOR_PAIR(1) | A_BOLD);
+            mvprintw(i + 3, 0, "> %.*s", static_cast<int>(name.size()), name.data());
+            attroff(COLOR_PAIR(1) | A_BOLD);
+            
+            attron(COLOR_PAIR(2));
+            mvprintw(i + 3, max_x - 30, "%.*s", static_cast<int>(path.size()), path.data());
+            attroff(COLOR_PAIR(2));
+        } else {
+            mvprintw(i + 3, 2, "%.*s", static_cast<int>(name.size()), name.data());
+        }
+    }
+}
+
+void interactive_search() {
+    std::string query = search_term;
+    std::string shown_query;
+    std::vector<Match> results;
+    size_t total = 0;
+    bool total_exact = true;
+    bool searching = true;
+    bool dirty = true;
+
+    SearchWorker worker;
+    worker.submit(query);
+    set_escdelay(25);
+    timeout(20);
+
+    while (true) {
+        if (worker.take_result(shown_query, results, total, total_exact)) {
+            searching = shown_query != query;
+            selected_index = std::min(selected_index, std::max(0, static_cast<int>(results.size()) - 1));
+            dirty = true;
+        }
+
+        if (dirty) {
+            int max_y, max_x;
+            getmaxyx(stdscr, max_y, max_x);
+            max_display_items = max_y - 4;
+            erase();
+
+            attron(A_BOLD);
+            mvprintw(0, 0, "> %s", query.c_str());
+            attroff(A_BOLD);
+            mvprintw(1, 0, "%zu/%zu%s files%s. Type to search, arrows to navigate, Enter to open, Esc to quit.",
+                     results.size(), total, total_exact ? "" : "+", searching ? " (searching)" : "");
+            mvhline(2, 0, ACS_HLINE, max_x);
+            draw_results(results, max_x);
+            refresh();
+            dirty = false;
+        }
+
+        int ch = getch();
+        if (ch == ERR) {
+            continue;
+        }
+        dirty = true;
+        switch (ch) {
+            case KEY_UP:
+                if (selected_index > 0) {
+                    selected_index--;
+                }
+                break;
+            case KEY_DOWN:
+                if (selected_index < static_cast<int>(results.size()) - 1) {
+                    selected_index++;
+                }
+                break;
+            case KEY_RESIZE:
+                break;
+            case '\n':
+                if (!results.empty() && !searching) {
+                    cleanup_ncurses();
+                    open_file(file_cache.path(file_cache[results[selected_index].index]));
+                    return;
+                }
+                break;
+            case 27:
+                return;
+            case KEY_BACKSPACE:
+            case 127:
+            case 8:
+                if (!query.empty()) {
+                    query.pop_back();
+                    worker.submit(query);
+                    searching = true;
+                }
+                break;
+            case 21:
+                query.clear();
+                worker.submit(query);
+                searching = true;
+                break;
+            default:
+                if (ch >= 32 && ch < 127) {
+                    query.push_back(static_cast<char>(ch));
+                    selected_index = 0;
+                    scroll_offset = 0;
+                    worker.submit(query);
+                    searching = true;
+                }
+                break;
+        }
+    }
+}
+
+SearchWorker::SearchWorker() : thread(&SearchWorker::run, this) {}
+
+SearchWorker::~SearchWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        cancelled.store(true);
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void SearchWorker::submit(const std::string& query) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        request = query;
+        has_request = true;
+        cancelled.store(true);
+    }
+    wake.notify_one();
+}
+
+bool SearchWorker::take_result(std::string& query, std::vector<Match>& matches, size_t& total, bool& total_exact) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!has_result) {
+        return false;
+    }
+    query = result_query;
+    matches.swap(results);
+    total = result_total;
+    total_exact = result_total_exact;
+    has_result = false;
+    return true;
+}
+
+void SearchWorker::run() {
+    while (true) {
+        std::string query;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || has_request; });
+            if (stopping) {
+                return;
+            }
+            query = request;
+            has_request = false;
+            cancelled.store(false);
+        }
+        search(query);
+    }
+}
+
+void SearchWorker::search(const std::string& query) {
+    std::vector<Match> matches;
+    size_t total = 0;
+    bool total_exact = true;
+
+    if (query.empty()) {
+        size_t end = std::min(file_cache.scope_end, file_cache.scope_begin + max_results);
+        for (size_t i = file_cache.scope_begin; i < end; ++i) {
+            matches.push_back({0, i});
+        }
+        total = file_cache.scope_end - file_cache.scope_begin;
+        narrowed_query.clear();
+        narrowed_matches.clear();
+    } else {
+        // Every match of a query also matches each of its prefixes (names are at
+        // most NAME_MAX bytes, so substring scores never go negative).
+        FuzzyPattern pattern(query);
+        std::vector<size_t> matched;
+        MatchOptions options;
+        options.matched = &matched;
+        options.cancelled = &cancelled;
+        bool narrow = !narrowed_query.empty() && query.compare(0, narrowed_query.size(), narrowed_query) == 0;
+        if (narrow) {
+            options.candidates = &narrowed_matches;
+        }
+        matches = search_files(pattern, max_results, total, total_exact, options);
+        if (cancelled.load()) {
+            return;
+        }
+        // A trigram-index answer does not list every match, so it cannot seed narrowing.
+        if (total_exact) {
+            narrowed_query = query;
+            narrowed_matches.swap(matched);
+        } else {
+            narrowed_query.clear();
+            narrowed_matches.clear();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    result_query = query;
+    results.swap(matches);
+    result_total = total;
+    result_total_exact = total_exact;
+    has_result = true;
+}
+
+void open_file(std::string_view path) {
     const char* editor = getenv("EDITOR");
     if (!editor || strlen(editor) == 0) {
         editor = "vi";  
     }
     
-    std::string command = std::string(editor) + " \"" + path + "\"";
+    std::string command = std::string(editor) + " \"" + std::string(path) + "\"";
     system(command.c_str());
 }
 
-int fuzzy_match_score(const std::string& str, const std::string& pattern) {
+uint64_t char_mask(const char* str, size_t length) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < length; ++i) {
+        mask |= 1ULL << (static_cast<unsigned char>(str[i]) & 63);
+    }
+    return mask;
+}
+
+FuzzyPattern::FuzzyPattern(const std::string& pattern) : lower(pattern) {
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    char_mask = ::char_mask(lower.data(), lower.size());
+}
+
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+size_t find_substring_scalar(const char* str, size_t length, const char* pattern, size_t pattern_length) {
+    return std::string_view(str, length).find(std::string_view(pattern, pattern_length));
+}
+
+size_t find_byte_scalar(const char* str, size_t from, size_t length, char c) {
+    const void* found = memchr(str + from, c, length - from);
+    return found ? static_cast<const char*>(found) - str : std::string::npos;
+}
+
+// Vector scans over a lowercased name. They may read up to 63 bytes past the
+// end of the name, which LOWER_POOL_PADDING keeps inside the pool.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILESEARCH_SIMD 1
+
+size_t find_substring_sse2(const char* str, size_t length, const char* pattern, size_t pattern_length) {
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+    for (size_t i = 0; i + pattern_length <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i + pattern_length - 1));
+        unsigned bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+        while (bits) {
+            size_t pos = i + __builtin_ctz(bits);
+            if (pos + pattern_length > length) {
+                return std::string::npos;
+            }
+            if (memcmp(str + pos, pattern, pattern_length) == 0) {
+                return pos;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return std::string::npos;
+}
+
+size_t find_byte_sse2(const char* str, size_t from, size_t length, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    for (size_t i = from; i < length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+        unsigned bits = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (bits) {
+            size_t pos = i + __builtin_ctz(bits);
+            return pos < length ? pos : std::string::npos;
+        }
+    }
+    return std::string::npos;
+}
+
+__attribute__((target("avx2")))
+size_t find_substring_avx2(const char* str, size_t length, const char* pattern, size_t pattern_length) {
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+    for (size_t i = 0; i + pattern_length <= length; i += 32) {
+        __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i));
+        __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i + pattern_length - 1));
+        unsigned bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+        while (bits) {
+            size_t pos = i + __builtin_ctz(bits);
+            if (pos + pattern_length > length) {
+                return std::string::npos;
+            }
+            if (memcmp(str + pos, pattern, pattern_length) == 0) {
+                return pos;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return std::string::npos;
+}
+
+__attribute__((target("avx2")))
+size_t find_byte_avx2(const char* str, size_t from, size_t length, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (size_t i = from; i < length; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i));
+        unsigned bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (bits) {
+            size_t pos = i + __builtin_ctz(bits);
+            return pos < length ? pos : std::string::npos;
+        }
+    }
+    return std::string::npos;
+}
+
+SimdLevel simd_level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#else
+SimdLevel simd_level = SIMD_SCALAR;
+#endif
+
+size_t find_substring(const char* str, size_t length, const char* pattern, size_t pattern_length) {
+    if (pattern_length == 0) {
+        return 0;
+    }
+#ifdef FILESEARCH_SIMD
+    if (simd_level == SIMD_AVX2) {
+        return find_substring_avx2(str, length, pattern, pattern_length);
+    }
+    if (simd_level == SIMD_SSE2) {
+        return find_substring_sse2(str, length, pattern, pattern_length);
+    }
+#endif
+    return find_substring_scalar(str, length, pattern, pattern_length);
+}
+
+size_t find_byte(const char* str, size_t from, size_t length, char c) {
+#ifdef FILESEARCH_SIMD
+    if (simd_level == SIMD_AVX2) {
+        return find_byte_avx2(str, from, length, c);
+    }
+    if (simd_level == SIMD_SSE2) {
+        return find_byte_sse2(str, from, length, c);
+    }
+#endif
+    return find_byte_scalar(str, from, length, c);
+}
+
+// str must already be lowercase. Scores: 1000 for an exact match, 800 minus
+// the position for a substring, otherwise 10 per pattern character plus 5 per
+// character of the current consecutive run, or 0 when not a subsequence.
+int fuzzy_match_score(const FuzzyPattern& pattern, const char* str, size_t length) {
+    const std::string& lower = pattern.lower;
+    if (length == lower.size() && memcmp(str, lower.data(), length) == 0) {
+        return 1000;
+    }
+    
+    size_t pos = find_substring(str, length, lower.data(), lower.size());
+    if (pos != std::string::npos) {
+        return 800 - pos;
+    }
+    
+    int score = 0;
+    size_t str_idx = 0;
+    size_t consecutive = 0;
+    
+    for (char p : lower) {
+        size_t found = str_idx < length ? find_byte(str, str_idx, length, p) : std::string::npos;
+        if (found == std::string::npos) {
+            return 0;
+        }
+        consecutive = (found == str_idx) ? consecutive + 1 : 1;
+        str_idx = found + 1;
+        score += 10 + (consecutive * 5);
+    }
+    return score;
+}
+
+// The scorer from before NameKey and the vector scans, kept as the
+// reference for --selftest: it lowercases copies of both strings and walks
+// them byte by byte.
+int reference_match_score(const std::string& str, const std::string& pattern) {
     std::string str_lower = str;
     std::string pattern_lower = pattern;
     std::transform(str_lower.begin(), str_lower.end(), str_lower.begin(), ::tolower);
     std::transform(pattern_lower.begin(), pattern_lower.end(), pattern_lower.begin(), ::tolower);
-    
+
     if (str_lower == pattern_lower) {
         return 1000;
     }
-    
+
     size_t pos = str_lower.find(pattern_lower);
     if (pos != std::string::npos) {
         return 800 - pos;
     }
-    
+
     int score = 0;
     size_t str_idx = 0;
     size_t consecutive = 0;
-    
+
     for (char p : pattern_lower) {
         bool found = false;
-        
+
         while (str_idx < str_lower.size()) {
             if (str_lower[str_idx] == p) {
                 found = true;
@@ -394,11 +1982,11 @@ int fuzzy_match_score(const std::string& str, const std::string& pattern) {
                 str_idx++;
                 break;
             }
-            
+
             consecutive = 0;
             str_idx++;
         }
-        
+
         if (!found) {
             return 0;
         }
@@ -406,3 +1994,94 @@ int fuzzy_match_score(const std::string& str, const std::string& pattern) {
     }
     return score;
 }
+
+// Differential test of fuzzy_match_score() on every code path this CPU can
+// run against reference_match_score(). Names are random, from a small
+// alphabet so that most patterns match somewhere, and are followed by
+// random bytes instead of padding, as in the middle of the lowercase pool.
+// Patterns are random, cut out of the name, or a subsequence of it.
+bool run_selftest() {
+    static const char alphabet[] = "abcxyzABCXYZ019._-";
+    const size_t alphabet_size = sizeof(alphabet) - 1;
+    const size_t rounds = 200000;
+    std::vector<SimdLevel> levels = {SIMD_SCALAR};
+#ifdef FILESEARCH_SIMD
+    levels.push_back(SIMD_SSE2);
+    if (__builtin_cpu_supports("avx2")) {
+        levels.push_back(SIMD_AVX2);
+    }
+#endif
+    SimdLevel saved_level = simd_level;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    auto next_random = [&](size_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<size_t>(state % bound);
+    };
+
+    size_t failures = 0;
+    std::string name;
+    std::string pattern;
+    std::string lowered;
+    for (size_t round = 0; round < rounds && failures < 10; ++round) {
+        name.clear();
+        size_t name_length = next_random(round % 8 == 0 ? 8 : 96);
+        for (size_t i = 0; i < name_length; ++i) {
+            name += alphabet[next_random(alphabet_size)];
+        }
+        pattern.clear();
+        size_t kind = next_random(4);
+        if (kind == 0 && !name.empty()) {
+            size_t from = next_random(name.size());
+            pattern = name.substr(from, 1 + next_random(std::min<size_t>(name.size() - from, 12)));
+        } else if (kind == 1 && !name.empty()) {
+            for (size_t i = next_random(3); i < name.size(); i += 1 + next_random(6)) {
+                pattern += name[i];
+            }
+        } else if (kind == 2) {
+            pattern = name;
+        }
+        if (pattern.empty()) {
+            size_t pattern_length = 1 + next_random(8);
+            for (size_t i = 0; i < pattern_length; ++i) {
+                pattern += alphabet[next_random(alphabet_size)];
+            }
+        }
+        for (char& c : pattern) {
+            if (next_random(4) == 0) {
+                c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+            }
+        }
+
+        lowered = name;
+        std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+        for (size_t i = 0; i < LOWER_POOL_PADDING; ++i) {
+            lowered += alphabet[next_random(alphabet_size)];
+        }
+        FuzzyPattern fuzzy(pattern);
+        int expected = reference_match_score(name, pattern);
+        if (expected > 0 && (char_mask(lowered.data(), name.size()) & fuzzy.char_mask) != fuzzy.char_mask) {
+            std::cerr << "Self-test: byte mask rejects '" << name << "' for '" << pattern << "'" << std::endl;
+            failures++;
+        }
+        for (SimdLevel level : levels) {
+            simd_level = level;
+            int score = fuzzy_match_score(fuzzy, lowered.data(), name.size());
+            if (score != expected) {
+                static const char* level_names[] = {"scalar", "SSE2", "AVX2"};
+                std::cerr << "Self-test: " << level_names[level] << " scores '" << name << "' for '" << pattern
+                          << "' as " << score << ", expected " << expected << std::endl;
+                failures++;
+            }
+        }
+    }
+    simd_level = saved_level;
+
+    if (failures > 0) {
+        std::cerr << "Self-test failed." << std::endl;
+        return false;
+    }
+    std::cout << "Self-test passed: " << rounds << " names on " << levels.size() << " code paths." << std::endl;
+    return true;
+}
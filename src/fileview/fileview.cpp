@@ -1,6 +1,7 @@
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
 #include <cstring>
@@ -14,8 +15,19 @@
 #include <getopt.h>
 #include <regex>
 #include <map>
+#include <unordered_set>
 #include <csignal>
 #include <cstdlib>
+#include <climits>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
 // ANSI color codes
 #define COLOR_RESET   "\033[0m"
@@ -28,7 +40,11 @@
 #define COLOR_CYAN    "\033[36m"
 #define COLOR_WHITE   "\033[37m"
 
-std::map<std::string, std::string> extension_colors = {
+#define WALK_MAX_AHEAD 4096
+#define DIRENT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+std::map<std::string, std::string_view, std::less<>> extension_colors = {
     {".cpp", COLOR_CYAN},
     {".h", COLOR_CYAN},
     {".hpp", COLOR_CYAN},
@@ -51,29 +67,245 @@ std::map<std::string, std::string> extension_colors = {
     {".gz", COLOR_YELLOW}
 };
 
+// One directory entry as listed by getdents64; type is a DT_* value.
+struct DirEntry {
+    std::string name;
+    unsigned char type;
+};
+
+enum FilterMatch {
+    FILTER_LITERAL,
+    FILTER_SUFFIX,
+    FILTER_PREFIX,
+    FILTER_GLOB
+};
+
+// One --exclude/--include rule. Globs of the form "name", "*suffix" and
+// "prefix*" are compared directly instead of going through glob_match().
+struct FilterRule {
+    std::string pattern;
+    std::string literal;
+    FilterMatch match;
+    bool include;
+    bool dir_only;
+    bool anchored;
+};
+
+// --exclude, --include and --exclude-from rules with gitignore semantics,
+// in command line order. Excluded entries are neither stat()ed nor shown,
+// and excluded directories are not read.
+struct PathFilter {
+    std::vector<FilterRule> rules;
+    bool anchored = false;
+
+    void add(std::string pattern, bool include);
+    bool load(const std::string& path);
+    bool excluded(const char* relative, const char* name, bool is_dir) const;
+};
+
+// The metadata fileview shows or filters on. Entries that need no stat()
+// only have the S_IFDIR bit of mode set, for directories. blocks, dev,
+// ino and links are only filled in for --du.
+struct EntryInfo {
+    mode_t mode = 0;
+    off_t size = 0;
+    time_t mtime = 0;
+    uint64_t blocks = 0;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    nlink_t links = 0;
+};
+
+// System calls made by the walk, and the entries it printed (--benchmark).
+struct WalkCounters {
+    std::atomic<uint64_t> opens{0};
+    std::atomic<uint64_t> getdents{0};
+    std::atomic<uint64_t> stats{0};
+    std::atomic<uint64_t> entries{0};
+};
+
+// Buffered stdout. Lines collect in one reusable buffer, which is written
+// when it fills up and at exit. When a reader is attached (a terminal or a
+// pipe), it is also written before the emitter blocks on a worker.
+struct OutputBuffer {
+    std::string buffer;
+    bool reader = false;
+
+    void append(std::string_view text) {
+        buffer.append(text);
+        if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+            flush();
+        }
+    }
+    void flush();
+};
+
+struct TreeNode;
+
+// One listed entry: where its line ends in TreeNode::text, and the
+// directory node below it, which is null at --max-depth.
+struct TreeLine {
+    size_t end;
+    TreeNode* child;
+    bool directory;
+};
+
+// One directory of the tree. Whichever thread claims it reads and stats
+// its entries and renders their lines into text, without the prefix and
+// connector; the emitter prints them once done is set. For --prune-empty
+// the emitter sets matched once it knows whether anything below matches.
+struct TreeNode {
+    std::string path;
+    int level = 0;
+    std::atomic<bool> claimed{false};
+    std::atomic<bool> done{false};
+    std::string text;
+    std::vector<TreeLine> lines;
+    signed char matched = -1;
+};
+
+// Parallel tree walk (--jobs). Workers take directories from a shared
+// stack, newest first, so they stay close to the part of the tree being
+// printed. The main thread prints finished directories in tree order and
+// scans a directory itself when no worker has started on it yet. Workers
+// pause while WALK_MAX_AHEAD scanned directories wait to be printed.
+// Nodes live in per-thread shards until the walk ends, so stale stack
+// entries stay valid; their lines are freed once printed. prefix holds
+// the emitter's current indentation and grows and shrinks with it.
+// With --prune-empty the emitter looks ahead into a subdirectory until it
+// finds a matching file, and drops subtrees that turn out to have none.
+struct TreeWalker {
+    std::vector<std::deque<TreeNode>> shards;
+    std::vector<TreeNode*> tasks;
+    std::mutex mutex;
+    std::condition_variable work;
+    std::condition_variable ready;
+    TreeNode* awaited = nullptr;
+    size_t ahead = 0;
+    bool finished = false;
+    std::string prefix;
+
+    explicit TreeWalker(int jobs) : shards(jobs) {}
+    void walk(const std::string& root);
+    void worker(size_t id);
+    void emit(TreeNode* node);
+    void wait_for(TreeNode* node);
+    bool matches(TreeNode* node);
+    size_t next_shown(TreeNode* node, size_t from);
+    void release(TreeNode* node);
+    void scan(size_t id, TreeNode* node);
+};
+
+// Totals of a subtree in --du mode: apparent sizes, allocated blocks in
+// bytes, and non-directory entries.
+struct DuTotals {
+    uint64_t apparent = 0;
+    uint64_t disk = 0;
+    uint64_t files = 0;
+};
+
+struct DuNode;
+
+// One entry of a directory in --du mode. duplicate marks a hard link to
+// a file that was already counted.
+struct DuEntry {
+    std::string name;
+    EntryInfo info;
+    DuNode* child = nullptr;
+    bool duplicate = false;
+
+    uint64_t disk_usage() const;
+};
+
+// matched is set if any entry below passes the filters (--prune-empty).
+struct DuNode {
+    std::string path;
+    std::vector<DuEntry> entries;
+    DuTotals totals;
+    bool matched = false;
+};
+
+struct FileId {
+    dev_t dev;
+    ino_t ino;
+
+    bool operator==(const FileId& other) const { return dev == other.dev && ino == other.ino; }
+};
+
+struct FileIdHash {
+    size_t operator()(const FileId& id) const {
+        return std::hash<uint64_t>()(static_cast<uint64_t>(id.ino) * 31 + static_cast<uint64_t>(id.dev));
+    }
+};
+
+// --du: reads and lstat()s the whole tree on --jobs threads, staying on
+// the file system of the root, and prints it once every total is known.
+// The thread that scans a directory sums its files; subtree totals and
+// hard-linked files are added up afterwards in name order, so the first
+// link of a file in that order is the one counted.
+struct DuWalker {
+    std::vector<std::deque<DuNode>> shards;
+    std::vector<DuNode*> tasks;
+    std::mutex mutex;
+    std::condition_variable work;
+    size_t active = 0;
+    dev_t root_device = 0;
+    std::string prefix;
+
+    explicit DuWalker(int jobs) : shards(jobs) {}
+    void run(const std::string& root);
+    void worker(size_t id);
+    std::vector<DuNode*> scan(size_t id, DuNode* node);
+    void add_up(DuNode* node, std::unordered_set<FileId, FileIdHash>& seen);
+    bool listed(const DuEntry& entry) const;
+    void print(DuNode* node, int level);
+    void append_usage(const DuTotals& totals, bool count_files);
+};
+
 bool show_sizes = false;
 bool show_times = false;
 bool show_permissions = false;
 std::string type_filter;
 long min_size = 0;
+int num_jobs = 0;
+bool benchmark = false;
+bool du_mode = false;
+bool sort_by_size = false;
+size_t top_entries = 0;
+int max_depth = 0;
+bool prune_empty = false;
+PathFilter path_filter;
+std::string walk_root;
+WalkCounters walk_counters;
+OutputBuffer output;
 
-volatile sig_atomic_t interrupted = 0;
+// Set by the SIGINT handler and read by the walker threads.
+std::atomic<bool> interrupted{false};
 
 void signal_handler(int signal) {
     if (signal == SIGINT) {
-        interrupted = 1;
-        std::cout << "\nInterrupted. Exiting..." << std::endl;
+        interrupted = true;
     }
 }
 
 void print_usage();
-void print_directory_tree(const std::string& path, int level = 0, const std::string& prefix = "");
+void print_directory_tree(const std::string& path);
+void print_disk_usage(const std::string& path);
+int read_directory(const std::string& path, std::vector<DirEntry>& entries);
+unsigned int wanted_fields();
+bool needs_stat(unsigned char type);
+bool stat_entry(int dir_fd, const char* name, unsigned int fields, bool follow, EntryInfo& info);
 std::string format_size(long size);
 std::string format_permissions(mode_t mode);
 std::string format_time(time_t time);
-std::string get_file_extension(const std::string& filename);
-bool matches_filter(const std::string& path, const struct stat& st);
-std::string get_color_for_file(const std::string& filename, mode_t mode);
+std::string_view get_file_extension(std::string_view filename);
+bool matches_filter(const std::string& name, const EntryInfo& info);
+bool filter_entry(int dir_fd, std::string_view relative, const DirEntry& entry, unsigned int fields, EntryInfo& info);
+bool listed_below(const std::string& path);
+bool excluded_entry(std::string_view directory, const std::string& name, bool is_dir);
+bool glob_match(const char* pattern, const char* text);
+std::string_view relative_path(std::string_view path);
+std::string_view get_color_for_file(std::string_view filename, mode_t mode);
 long parse_size(const std::string& size_str);
 
 int main(int argc, char* argv[]) {
@@ -85,12 +317,22 @@ int main(int argc, char* argv[]) {
         {"perms", no_argument, 0, 'p'},
         {"type", required_argument, 0, 'T'},
         {"minsize", required_argument, 0, 'm'},
+        {"jobs", required_argument, 0, 'j'},
+        {"benchmark", no_argument, 0, 'b'},
+        {"du", no_argument, 0, 'd'},
+        {"sort", required_argument, 0, 'o'},
+        {"top", required_argument, 0, 'n'},
+        {"max-depth", required_argument, 0, 'L'},
+        {"prune-empty", no_argument, 0, 'P'},
+        {"exclude", required_argument, 0, 'x'},
+        {"include", required_argument, 0, 'i'},
+        {"exclude-from", required_argument, 0, 'E'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     int opt;
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "stpT:m:h", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "stpT:m:j:bdo:n:L:Px:i:E:h", long_options, &option_index)) != -1) {
         switch (opt) {
             case 's':
                 show_sizes = true;
@@ -107,6 +349,55 @@ int main(int argc, char* argv[]) {
             case 'm':
                 min_size = parse_size(optarg);
                 break;
+            case 'j':
+                num_jobs = atoi(optarg);
+                if (num_jobs < 1) {
+                    std::cerr << "Error: --jobs must be a positive number." << std::endl;
+                    return 1;
+                }
+                break;
+            case 'b':
+                benchmark = true;
+                break;
+            case 'd':
+                du_mode = true;
+                break;
+            case 'o':
+                if (strcmp(optarg, "size") == 0) {
+                    sort_by_size = true;
+                } else if (strcmp(optarg, "name") != 0) {
+                    std::cerr << "Error: --sort must be name or size." << std::endl;
+                    return 1;
+                }
+                break;
+            case 'n':
+                if (atol(optarg) < 1) {
+                    std::cerr << "Error: --top must be a positive number." << std::endl;
+                    return 1;
+                }
+                top_entries = atol(optarg);
+                sort_by_size = true;
+                break;
+            case 'L':
+                max_depth = atoi(optarg);
+                if (max_depth < 1) {
+                    std::cerr << "Error: --max-depth must be a positive number." << std::endl;
+                    return 1;
+                }
+                break;
+            case 'P':
+                prune_empty = true;
+                break;
+            case 'x':
+            case 'i':
+                path_filter.add(optarg, opt == 'i');
+                break;
+            case 'E':
+                if (!path_filter.load(optarg)) {
+                    std::cerr << "Error: Could not read " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             case 'h':
                 print_usage();
                 return 0;
@@ -118,13 +409,43 @@ int main(int argc, char* argv[]) {
     if (optind < argc) {
         directory = argv[optind];
     }
+    if (sort_by_size && !du_mode) {
+        std::cerr << "Error: --sort=size and --top require --du." << std::endl;
+        return 1;
+    }
     struct stat st;
     if (stat(directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
         std::cerr << "Error: " << directory << " is not a valid directory." << std::endl;
         return 1;
     }
-    std::cout << COLOR_BOLD << "Directory Tree: " << directory << COLOR_RESET << std::endl;
-    print_directory_tree(directory);
+    walk_root = directory;
+    struct stat out;
+    output.reader = isatty(STDOUT_FILENO) || (fstat(STDOUT_FILENO, &out) == 0 && S_ISFIFO(out.st_mode));
+    if (benchmark) {
+        auto start = std::chrono::steady_clock::now();
+        if (du_mode) {
+            print_disk_usage(directory);
+        } else {
+            print_directory_tree(directory);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "Walked " << walk_counters.entries << " entries in " << static_cast<long long>(seconds * 1000)
+                  << " ms: " << walk_counters.opens << " open, " << walk_counters.getdents << " getdents64, "
+                  << walk_counters.stats << " statx calls" << std::endl;
+        return 0;
+    }
+    if (du_mode) {
+        print_disk_usage(directory);
+    } else {
+        output.append(COLOR_BOLD "Directory Tree: ");
+        output.append(directory);
+        output.append(COLOR_RESET "\n");
+        print_directory_tree(directory);
+    }
+    output.flush();
+    if (interrupted) {
+        std::cout << "\nInterrupted. Exiting..." << std::endl;
+    }
     return 0;
 }
 
@@ -138,58 +459,622 @@ void print_usage() {
     std::cout << "  -p, --perms           Show file permissions" << std::endl;
     std::cout << "  -T, --type=EXT        Filter by file extension (e.g., .cpp)" << std::endl;
     std::cout << "  -m, --minsize=SIZE    Filter by minimum size (e.g., 1MB, 500KB)" << std::endl;
+    std::cout << "  -j, --jobs=N          Number of threads reading directories (default: CPU count)" << std::endl;
+    std::cout << "  -d, --du              Show the disk usage, apparent size and file count of every entry," << std::endl;
+    std::cout << "                        counting hard links once and staying on one file system" << std::endl;
+    std::cout << "  -o, --sort=ORDER      With --du, list entries by name (default) or by size, largest first" << std::endl;
+    std::cout << "  -n, --top=N           With --du, only list the N largest entries of each directory" << std::endl;
+    std::cout << "  -L, --max-depth=N     Only list entries up to N levels below DIRECTORY" << std::endl;
+    std::cout << "  -P, --prune-empty     Hide directories with nothing below them that is listed; directories" << std::endl;
+    std::cout << "                        at --max-depth are searched to their full depth to decide" << std::endl;
+    std::cout << "  -x, --exclude=PATTERN Skip entries matching a gitignore-style PATTERN and do not read" << std::endl;
+    std::cout << "                        excluded directories (repeatable)" << std::endl;
+    std::cout << "  -i, --include=PATTERN Include matching entries again; the last matching rule wins (repeatable)" << std::endl;
+    std::cout << "  -E, --exclude-from=FILE  Read rules from a gitignore-style FILE ('!' lines include)" << std::endl;
+    std::cout << "  -b, --benchmark       Walk the tree without printing it and report the time and system calls" << std::endl;
     std::cout << "  -h, --help            Display this help and exit" << std::endl;
 }
 
-void print_directory_tree(const std::string& path, int level, const std::string& prefix) {
-    if (interrupted) {
-        return;
+void print_directory_tree(const std::string& path) {
+    int jobs = num_jobs;
+    if (jobs < 1) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
     }
-    DIR* dir = opendir(path.c_str());
-    if (!dir) {
-        return;
+    TreeWalker walker(jobs);
+    walker.walk(path);
+}
+
+void TreeWalker::walk(const std::string& root) {
+    TreeNode* node = &shards[0].emplace_back();
+    node->path = root;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < shards.size(); ++i) {
+        threads.emplace_back(&TreeWalker::worker, this, i);
+    }
+    emit(node);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
     }
-    std::vector<std::string> entries;
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    work.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void TreeWalker::worker(size_t id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work.wait(lock, [&] { return finished || (!tasks.empty() && ahead < WALK_MAX_AHEAD); });
+        if (finished) {
+            return;
+        }
+        TreeNode* node = tasks.back();
+        tasks.pop_back();
+        if (node->claimed.exchange(true)) {
             continue;
         }
-        entries.push_back(entry->d_name);
+        lock.unlock();
+        scan(id, node);
+        lock.lock();
+    }
+}
+
+// Prints node's lines, descending into each subdirectory right after its
+// own line, and waits for or scans nodes that are not done yet.
+void TreeWalker::emit(TreeNode* node) {
+    wait_for(node);
+    std::string_view text = node->text;
+    size_t printed = 0;
+    for (size_t i = next_shown(node, 0); i < node->lines.size() && !interrupted;) {
+        const TreeLine& line = node->lines[i];
+        size_t start = i > 0 ? node->lines[i - 1].end : 0;
+        size_t next = next_shown(node, i + 1);
+        bool last = next == node->lines.size();
+        if (!benchmark) {
+            output.append(prefix);
+            output.append(last ? "└── " : "├── ");
+            output.append(text.substr(start, line.end - start));
+        }
+        printed++;
+        if (line.child) {
+            size_t depth = prefix.size();
+            prefix += last ? "    " : "│   ";
+            emit(line.child);
+            prefix.resize(depth);
+        }
+        i = next;
+    }
+    walk_counters.entries += printed;
+    release(node);
+}
+
+void TreeWalker::wait_for(TreeNode* node) {
+    if (node->done.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (!node->claimed.exchange(true)) {
+        scan(0, node);
+    } else {
+        // Show what is ready before blocking, so a pager keeps up.
+        if (output.reader) {
+            output.flush();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        awaited = node;
+        ready.wait(lock, [&] { return node->done.load(std::memory_order_acquire); });
+        awaited = nullptr;
     }
-    closedir(dir);
-    std::sort(entries.begin(), entries.end());
-    for (size_t i = 0; i < entries.size(); ++i) {
+}
+
+// Whether node or a directory below it lists a file (--prune-empty).
+// Stops at the first one; subtrees without any are released right away,
+// since none of their lines will be printed.
+bool TreeWalker::matches(TreeNode* node) {
+    if (node->matched >= 0) {
+        return node->matched;
+    }
+    wait_for(node);
+    bool found = false;
+    for (const TreeLine& line : node->lines) {
+        if (!line.directory || !line.child || matches(line.child)) {
+            found = true;
+            break;
+        }
         if (interrupted) {
+            break;
+        }
+    }
+    node->matched = found;
+    if (!found) {
+        release(node);
+    }
+    return found;
+}
+
+// The index of the first line from from on that is printed: every line
+// unless --prune-empty hides a directory line.
+size_t TreeWalker::next_shown(TreeNode* node, size_t from) {
+    if (!prune_empty) {
+        return from;
+    }
+    while (from < node->lines.size()) {
+        const TreeLine& line = node->lines[from];
+        if (!line.directory || !line.child || matches(line.child)) {
+            break;
+        }
+        from++;
+    }
+    return from;
+}
+
+// Frees the lines of a node that was printed or pruned, and lets the
+// workers scan ahead again.
+void TreeWalker::release(TreeNode* node) {
+    std::string().swap(node->text);
+    std::vector<TreeLine>().swap(node->lines);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ahead--;
+    }
+    work.notify_one();
+}
+
+// Reads, sorts and stats one directory and renders its lines. Entries are
+// listed with getdents64 and only stat()ed (relative to the directory,
+// following symlinks) when their d_type does not already say enough.
+// Excluded entries and files --type rules out are dropped before that,
+// and directories at --max-depth get no node. With --prune-empty, those
+// are searched instead and dropped if nothing below them is listed.
+void TreeWalker::scan(size_t id, TreeNode* node) {
+    std::vector<TreeNode*> children;
+    std::vector<DirEntry> entries;
+    int dir_fd = interrupted ? -1 : read_directory(node->path, entries);
+    if (dir_fd >= 0) {
+        std::sort(entries.begin(), entries.end(), [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+        unsigned int fields = wanted_fields();
+        std::string_view relative = relative_path(node->path);
+        bool descend = max_depth == 0 || node->level + 1 < max_depth;
+        for (size_t i = 0; i < entries.size() && !interrupted; ++i) {
+            const DirEntry& entry = entries[i];
+            EntryInfo info;
+            if (!filter_entry(dir_fd, relative, entry, fields, info)) {
+                continue;
+            }
+            if (S_ISDIR(info.mode) && !descend && prune_empty && !listed_below(node->path + "/" + entry.name)) {
+                continue;
+            }
+            std::string& text = node->text;
+            text += get_color_for_file(entry.name, info.mode);
+            text += entry.name;
+            text += COLOR_RESET;
+            if (show_sizes && !S_ISDIR(info.mode)) {
+                text += " [";
+                text += format_size(info.size);
+                text += ']';
+            }
+            if (show_times) {
+                text += " [";
+                text += format_time(info.mtime);
+                text += ']';
+            }
+            if (show_permissions) {
+                text += " [";
+                text += format_permissions(info.mode);
+                text += ']';
+            }
+            text += '\n';
+            TreeNode* child = nullptr;
+            if (S_ISDIR(info.mode) && descend) {
+                child = &shards[id].emplace_back();
+                child->path = node->path + "/" + entry.name;
+                child->level = node->level + 1;
+                children.push_back(child);
+            }
+            node->lines.push_back({text.size(), child, S_ISDIR(info.mode)});
+        }
+        close(dir_fd);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.insert(tasks.end(), children.rbegin(), children.rend());
+        ahead++;
+        node->done.store(true, std::memory_order_release);
+        if (awaited == node) {
+            ready.notify_one();
+        }
+    }
+    if (!children.empty()) {
+        work.notify_all();
+    }
+}
+
+// Applies --type, the exclude rules and the other filters to one entry
+// of the directory open as dir_fd, stat()ing it only when needed.
+bool filter_entry(int dir_fd, std::string_view relative, const DirEntry& entry, unsigned int fields, EntryInfo& info) {
+    bool known_type = entry.type != DT_LNK && entry.type != DT_UNKNOWN;
+    if (known_type && entry.type != DT_DIR && !type_filter.empty() && get_file_extension(entry.name) != type_filter) {
+        return false;
+    }
+    if (known_type && excluded_entry(relative, entry.name, entry.type == DT_DIR)) {
+        return false;
+    }
+    info.mode = entry.type == DT_DIR ? S_IFDIR : 0;
+    if (needs_stat(entry.type) && !stat_entry(dir_fd, entry.name.c_str(), fields, true, info)) {
+        return false;
+    }
+    if (!known_type && excluded_entry(relative, entry.name, S_ISDIR(info.mode))) {
+        return false;
+    }
+    return matches_filter(entry.name, info);
+}
+
+// Whether a directory beyond --max-depth holds a file that would be listed
+// without the limit (--prune-empty). Stops at the first one, and does not
+// follow symlinks to directories, since nothing bounds the depth here.
+bool listed_below(const std::string& path) {
+    std::vector<DirEntry> entries;
+    int dir_fd = interrupted ? -1 : read_directory(path, entries);
+    if (dir_fd < 0) {
+        return false;
+    }
+    unsigned int fields = wanted_fields();
+    std::string_view relative = relative_path(path);
+    std::vector<std::string> subdirs;
+    bool found = false;
+    for (const DirEntry& entry : entries) {
+        EntryInfo info;
+        if (!filter_entry(dir_fd, relative, entry, fields, info)) {
+            continue;
+        }
+        if (!S_ISDIR(info.mode)) {
+            found = true;
+            break;
+        }
+        if (entry.type != DT_LNK) {
+            subdirs.push_back(path + "/" + entry.name);
+        }
+    }
+    close(dir_fd);
+    for (size_t i = 0; i < subdirs.size() && !found && !interrupted; ++i) {
+        found = listed_below(subdirs[i]);
+    }
+    return found;
+}
+
+void print_disk_usage(const std::string& path) {
+    int jobs = num_jobs;
+    if (jobs < 1) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    DuWalker walker(jobs);
+    walker.run(path);
+}
+
+void DuWalker::run(const std::string& root) {
+    EntryInfo info;
+    if (!stat_entry(AT_FDCWD, root.c_str(), wanted_fields(), true, info)) {
+        return;
+    }
+    root_device = info.dev;
+    DuNode* node = &shards[0].emplace_back();
+    node->path = root;
+    tasks.push_back(node);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < shards.size(); ++i) {
+        threads.emplace_back(&DuWalker::worker, this, i);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (interrupted) {
+        return;
+    }
+
+    std::unordered_set<FileId, FileIdHash> seen;
+    add_up(node, seen);
+    node->totals.apparent += info.size;
+    node->totals.disk += info.blocks * 512;
+    if (benchmark) {
+        return;
+    }
+    output.append(COLOR_BOLD "Directory Tree: ");
+    output.append(root);
+    output.append(COLOR_RESET);
+    append_usage(node->totals, true);
+    output.append("\n");
+    print(node, 0);
+}
+
+void DuWalker::worker(size_t id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work.wait(lock, [&] { return !tasks.empty() || active == 0 || interrupted; });
+        if (tasks.empty() || interrupted) {
             return;
         }
-        bool is_last = (i == entries.size() - 1);
-        std::string full_path = path + "/" + entries[i];
-        struct stat st;
-        if (stat(full_path.c_str(), &st) != 0) {
+        DuNode* node = tasks.back();
+        tasks.pop_back();
+        active++;
+        lock.unlock();
+        std::vector<DuNode*> children = scan(id, node);
+        lock.lock();
+        active--;
+        tasks.insert(tasks.end(), children.begin(), children.end());
+        if (!children.empty() || (tasks.empty() && active == 0)) {
+            work.notify_all();
+        }
+    }
+}
+
+// Lists and lstat()s one directory, sums its files other than hard links
+// and returns its subdirectories on the same file system. Excluded entries
+// are skipped before they are stat()ed and count nowhere.
+std::vector<DuNode*> DuWalker::scan(size_t id, DuNode* node) {
+    std::vector<DuNode*> children;
+    std::vector<DirEntry> entries;
+    int dir_fd = read_directory(node->path, entries);
+    if (dir_fd < 0) {
+        return children;
+    }
+    std::sort(entries.begin(), entries.end(), [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+    unsigned int fields = wanted_fields();
+    std::string_view relative = relative_path(node->path);
+    node->entries.reserve(entries.size());
+    for (size_t i = 0; i < entries.size() && !interrupted; ++i) {
+        unsigned char type = entries[i].type;
+        if (type != DT_UNKNOWN && excluded_entry(relative, entries[i].name, type == DT_DIR)) {
+            continue;
+        }
+        DuEntry entry;
+        if (!stat_entry(dir_fd, entries[i].name.c_str(), fields, false, entry.info)) {
             continue;
         }
-        if (!matches_filter(full_path, st)) {
+        if (type == DT_UNKNOWN && excluded_entry(relative, entries[i].name, S_ISDIR(entry.info.mode))) {
             continue;
         }
-        std::string new_prefix = prefix + (is_last ? "└── " : "├── ");
-        std::string next_prefix = prefix + (is_last ? "    " : "│   ");
-        std::string color = get_color_for_file(entries[i], st.st_mode);
-        std::cout << prefix << (is_last ? "└── " : "├── ") << color << entries[i] << COLOR_RESET;
-        if (show_sizes && !S_ISDIR(st.st_mode)) {
-            std::cout << " [" << format_size(st.st_size) << "]";
+        if (S_ISDIR(entry.info.mode)) {
+            if (entry.info.dev != root_device) {
+                continue;
+            }
+            entry.child = &shards[id].emplace_back();
+            entry.child->path = node->path + "/" + entries[i].name;
+            children.push_back(entry.child);
+        } else if (entry.info.links <= 1) {
+            node->totals.apparent += entry.info.size;
+            node->totals.disk += entry.info.blocks * 512;
+            node->totals.files++;
+        }
+        entry.name = std::move(entries[i].name);
+        node->entries.push_back(std::move(entry));
+    }
+    close(dir_fd);
+    walk_counters.entries += node->entries.size();
+    return children;
+}
+
+// Adds the totals of node's subdirectories and its hard-linked files to
+// its own, in name order, so that the first link of a file in that order
+// is the one counted. Then notes whether node lists anything.
+void DuWalker::add_up(DuNode* node, std::unordered_set<FileId, FileIdHash>& seen) {
+    for (DuEntry& entry : node->entries) {
+        if (entry.child) {
+            add_up(entry.child, seen);
+            entry.child->totals.apparent += entry.info.size;
+            entry.child->totals.disk += entry.info.blocks * 512;
+            node->totals.apparent += entry.child->totals.apparent;
+            node->totals.disk += entry.child->totals.disk;
+            node->totals.files += entry.child->totals.files;
+        } else if (entry.info.links > 1) {
+            if (seen.insert({entry.info.dev, entry.info.ino}).second) {
+                node->totals.apparent += entry.info.size;
+                node->totals.disk += entry.info.blocks * 512;
+                node->totals.files++;
+            } else {
+                entry.duplicate = true;
+            }
+        }
+    }
+    for (const DuEntry& entry : node->entries) {
+        if (listed(entry)) {
+            node->matched = true;
+            break;
+        }
+    }
+}
+
+uint64_t DuEntry::disk_usage() const {
+    return child ? child->totals.disk : duplicate ? 0 : info.blocks * 512;
+}
+
+// Whether entry is listed: --minsize and --type hide entries, and
+// --prune-empty directories with nothing listed below them.
+bool DuWalker::listed(const DuEntry& entry) const {
+    if (min_size > 0 && entry.disk_usage() < static_cast<uint64_t>(min_size)) {
+        return false;
+    }
+    if (!entry.child && !type_filter.empty() && get_file_extension(entry.name) != type_filter) {
+        return false;
+    }
+    return !prune_empty || !entry.child || entry.child->matched;
+}
+
+// Prints node's entries with their usage. Hidden entries still count in
+// the totals; --top keeps the largest ones and sums up the rest in a
+// final line. Directories at --max-depth are listed with their totals
+// but not expanded.
+void DuWalker::print(DuNode* node, int level) {
+    std::vector<const DuEntry*> shown;
+    for (const DuEntry& entry : node->entries) {
+        if (listed(entry)) {
+            shown.push_back(&entry);
+        }
+    }
+    if (sort_by_size) {
+        std::stable_sort(shown.begin(), shown.end(), [](const DuEntry* a, const DuEntry* b) {
+            return a->disk_usage() > b->disk_usage();
+        });
+    }
+    DuTotals rest;
+    size_t hidden = 0;
+    if (top_entries > 0 && shown.size() > top_entries) {
+        for (size_t i = top_entries; i < shown.size(); ++i) {
+            const DuEntry& entry = *shown[i];
+            if (entry.child) {
+                rest.apparent += entry.child->totals.apparent;
+                rest.disk += entry.child->totals.disk;
+                rest.files += entry.child->totals.files;
+            } else if (!entry.duplicate) {
+                rest.apparent += entry.info.size;
+                rest.disk += entry.info.blocks * 512;
+                rest.files++;
+            }
+        }
+        hidden = shown.size() - top_entries;
+        shown.resize(top_entries);
+    }
+
+    for (size_t i = 0; i < shown.size() && !interrupted; ++i) {
+        const DuEntry& entry = *shown[i];
+        bool is_last = i == shown.size() - 1 && hidden == 0;
+        output.append(prefix);
+        output.append(is_last ? "└── " : "├── ");
+        output.append(get_color_for_file(entry.name, entry.info.mode));
+        output.append(entry.name);
+        output.append(COLOR_RESET);
+        if (entry.child) {
+            append_usage(entry.child->totals, true);
+        } else if (entry.duplicate) {
+            output.append(" [hard link, counted before]");
+        } else {
+            append_usage({static_cast<uint64_t>(entry.info.size), entry.info.blocks * 512, 1}, false);
         }
         if (show_times) {
-            std::cout << " [" << format_time(st.st_mtime) << "]";
+            output.append(" [" + format_time(entry.info.mtime) + "]");
         }
         if (show_permissions) {
-            std::cout << " [" << format_permissions(st.st_mode) << "]";
+            output.append(" [" + format_permissions(entry.info.mode) + "]");
+        }
+        output.append("\n");
+        if (entry.child && (max_depth == 0 || level + 1 < max_depth)) {
+            size_t depth = prefix.size();
+            prefix += is_last ? "    " : "│   ";
+            print(entry.child, level + 1);
+            prefix.resize(depth);
+        }
+    }
+    if (hidden > 0 && !interrupted) {
+        output.append(prefix);
+        output.append("└── " + std::to_string(hidden) + " more");
+        append_usage(rest, true);
+        output.append("\n");
+    }
+}
+
+void DuWalker::append_usage(const DuTotals& totals, bool count_files) {
+    std::string text = " [" + format_size(totals.disk) + " on disk, " + format_size(totals.apparent) + " apparent";
+    if (count_files) {
+        text += ", " + std::to_string(totals.files) + (totals.files == 1 ? " file" : " files");
+    }
+    text += "]";
+    output.append(text);
+}
+
+// Opens path and lists its entries except . and .. with getdents64 into a
+// per-thread buffer. Returns the directory's fd for stat_entry(), or -1.
+int read_directory(const std::string& path, std::vector<DirEntry>& entries) {
+    static thread_local std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+    walk_counters.opens.fetch_add(1, std::memory_order_relaxed);
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    while (true) {
+        walk_counters.getdents.fetch_add(1, std::memory_order_relaxed);
+        long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (length <= 0) {
+            break;
+        }
+        for (long offset = 0; offset < length;) {
+            const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            entries.push_back({entry->d_name, entry->d_type});
+        }
+    }
+    return fd;
+}
+
+// The statx fields the output needs: the type and mode always, the size
+// for -s and --minsize, the modification time for -t, and for --du the
+// allocated blocks and what identifies hard links.
+unsigned int wanted_fields() {
+    unsigned int fields = STATX_TYPE | STATX_MODE;
+    if (show_sizes || min_size > 0) {
+        fields |= STATX_SIZE;
+    }
+    if (du_mode) {
+        fields |= STATX_SIZE | STATX_BLOCKS | STATX_INO | STATX_NLINK;
+    }
+    if (show_times) {
+        fields |= STATX_MTIME;
+    }
+    return fields;
+}
+
+// Whether an entry of the given d_type has to be stat()ed. Directories
+// need it only for -t and -p. Files need at least their mode, which
+// decides the executable color, and symlinks and unknown types are
+// stat()ed to find out what they are.
+bool needs_stat(unsigned char type) {
+    if (type == DT_DIR) {
+        return show_times || show_permissions;
+    }
+    return true;
+}
+
+// Fills info for name in dir_fd, following symlinks like stat() if
+// follow is set and like lstat() otherwise. Uses statx() to request only
+// the given fields, or fstatat() on kernels without it.
+bool stat_entry(int dir_fd, const char* name, unsigned int fields, bool follow, EntryInfo& info) {
+    static std::atomic<bool> have_statx{true};
+    int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    walk_counters.stats.fetch_add(1, std::memory_order_relaxed);
+    if (have_statx.load(std::memory_order_relaxed)) {
+        struct statx stx;
+        if (statx(dir_fd, name, flags | AT_NO_AUTOMOUNT, fields, &stx) == 0) {
+            info.mode = stx.stx_mode;
+            info.size = static_cast<off_t>(stx.stx_size);
+            info.mtime = stx.stx_mtime.tv_sec;
+            info.blocks = stx.stx_blocks;
+            info.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            info.ino = stx.stx_ino;
+            info.links = stx.stx_nlink;
+            return true;
         }
-        std::cout << std::endl;
-        if (S_ISDIR(st.st_mode)) {
-            print_directory_tree(full_path, level + 1, next_prefix);
+        if (errno != ENOSYS) {
+            return false;
         }
+        have_statx = false;
     }
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, flags) != 0) {
+        return false;
+    }
+    info.mode = st.st_mode;
+    info.size = st.st_size;
+    info.mtime = st.st_mtime;
+    info.blocks = st.st_blocks;
+    info.dev = st.st_dev;
+    info.ino = st.st_ino;
+    info.links = st.st_nlink;
+    return true;
 }
 
 std::string format_size(long size) {
@@ -227,46 +1112,284 @@ std::string format_permissions(mode_t mode) {
 
 std::string format_time(time_t time) {
     char buffer[20];
-    struct tm* timeinfo = localtime(&time);
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", timeinfo);
+    struct tm timeinfo;
+    localtime_r(&time, &timeinfo);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &timeinfo);
     return std::string(buffer);
 }
 
-std::string get_file_extension(const std::string& filename) {
+std::string_view get_file_extension(std::string_view filename) {
     size_t pos = filename.find_last_of('.');
-    if (pos != std::string::npos) {
+    if (pos != std::string_view::npos) {
         return filename.substr(pos);
     }
-    return "";
+    return {};
 }
 
-bool matches_filter(const std::string& path, const struct stat& st) {
+bool matches_filter(const std::string& name, const EntryInfo& info) {
     if (!type_filter.empty()) {
-        std::string ext = get_file_extension(path);
-        if (ext != type_filter && !S_ISDIR(st.st_mode)) {
+        std::string_view ext = get_file_extension(name);
+        if (ext != type_filter && !S_ISDIR(info.mode)) {
             return false;
         }
     }
-    if (min_size > 0 && !S_ISDIR(st.st_mode) && st.st_size < min_size) {
+    if (min_size > 0 && !S_ISDIR(info.mode) && info.size < min_size) {
+        return false;
+    }
+    return true;
+}
+
+// Applies the --exclude rules to name in directory, a path below the
+// listed directory.
+bool excluded_entry(std::string_view directory, const std::string& name, bool is_dir) {
+    if (path_filter.rules.empty()) {
+        return false;
+    }
+    if (!path_filter.anchored || directory.empty()) {
+        return path_filter.excluded(name.c_str(), name.c_str(), is_dir);
+    }
+    static thread_local std::string relative;
+    relative.assign(directory);
+    relative += '/';
+    relative += name;
+    return path_filter.excluded(relative.c_str(), relative.c_str() + directory.size() + 1, is_dir);
+}
+
+// Adds one rule. A trailing '/' limits it to directories, and a '/' at
+// the start or in the middle anchors it to the listed directory; other
+// rules match the entry name at any depth.
+void PathFilter::add(std::string pattern, bool include) {
+    FilterRule rule;
+    rule.include = include;
+    rule.dir_only = false;
+    while (pattern.size() > 1 && pattern.back() == '/') {
+        pattern.pop_back();
+        rule.dir_only = true;
+    }
+    rule.anchored = pattern.find('/') != std::string::npos;
+    if (!pattern.empty() && pattern[0] == '/') {
+        pattern.erase(0, 1);
+    }
+    if (pattern.empty()) {
+        return;
+    }
+
+    size_t special = pattern.find_first_of("*?[\\");
+    if (special == std::string::npos) {
+        rule.match = FILTER_LITERAL;
+        rule.literal = pattern;
+    } else if (!rule.anchored && special == 0 && pattern.find_first_of("*?[\\", 1) == std::string::npos) {
+        rule.match = FILTER_SUFFIX;
+        rule.literal = pattern.substr(1);
+    } else if (!rule.anchored && special == pattern.size() - 1 && pattern.back() == '*') {
+        rule.match = FILTER_PREFIX;
+        rule.literal = pattern.substr(0, special);
+    } else {
+        rule.match = FILTER_GLOB;
+    }
+    rule.pattern = std::move(pattern);
+    anchored = anchored || rule.anchored;
+    rules.push_back(std::move(rule));
+}
+
+// Reads gitignore-style rules: blank lines and lines starting with '#'
+// are skipped, '!' turns a rule into an include, and a leading backslash
+// escapes either.
+bool PathFilter::load(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
         return false;
     }
+    char buffer[PATH_MAX + 2];
+    while (fgets(buffer, sizeof(buffer), file)) {
+        std::string line = buffer;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+            line.pop_back();
+        }
+        while (!line.empty() && line.back() == ' ' && (line.size() < 2 || line[line.size() - 2] != '\\')) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        bool include = line[0] == '!';
+        if (include) {
+            line.erase(0, 1);
+        } else if (line[0] == '\\' && line.size() > 1 && (line[1] == '#' || line[1] == '!')) {
+            line.erase(0, 1);
+        }
+        add(line, include);
+    }
+    fclose(file);
     return true;
 }
 
-std::string get_color_for_file(const std::string& filename, mode_t mode) {
+// relative is the entry's path below the listed directory and name points
+// at its last component. The last matching rule decides.
+bool PathFilter::excluded(const char* relative, const char* name, bool is_dir) const {
+    if (*relative == '\0') {
+        return false;
+    }
+    size_t name_length = 0;
+    for (auto rule = rules.rbegin(); rule != rules.rend(); ++rule) {
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+        const char* text = rule->anchored ? relative : name;
+        bool matched;
+        switch (rule->match) {
+            case FILTER_LITERAL:
+                matched = rule->literal == text;
+                break;
+            case FILTER_SUFFIX:
+                if (name_length == 0) {
+                    name_length = strlen(name);
+                }
+                matched = name_length >= rule->literal.size() &&
+                          memcmp(name + name_length - rule->literal.size(), rule->literal.data(), rule->literal.size()) == 0;
+                break;
+            case FILTER_PREFIX:
+                matched = strncmp(name, rule->literal.data(), rule->literal.size()) == 0;
+                break;
+            default:
+                matched = glob_match(rule->pattern.c_str(), text);
+                break;
+        }
+        if (matched) {
+            return !rule->include;
+        }
+    }
+    return false;
+}
+
+// Matches a glob against text. '*', '?' and bracket expressions stop at
+// '/', "**" crosses it, and "**/" also matches no directory at all.
+bool glob_match(const char* pattern, const char* text) {
+    while (*pattern) {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            pattern += 2;
+            bool slash = *pattern == '/';
+            if (slash) {
+                pattern++;
+            }
+            for (const char* rest = text;; rest++) {
+                if ((!slash || rest == text || rest[-1] == '/') && glob_match(pattern, rest)) {
+                    return true;
+                }
+                if (*rest == '\0') {
+                    return false;
+                }
+            }
+        }
+        if (*pattern == '*') {
+            pattern++;
+            for (const char* rest = text;; rest++) {
+                if (glob_match(pattern, rest)) {
+                    return true;
+                }
+                if (*rest == '\0' || *rest == '/') {
+                    return false;
+                }
+            }
+        }
+        if (*text == '\0') {
+            return false;
+        }
+        if ((*pattern == '?' || *pattern == '[') && *text == '/') {
+            return false;
+        }
+        if (*pattern == '?') {
+            pattern++;
+            text++;
+            continue;
+        }
+        if (*pattern == '[') {
+            const char* p = pattern + 1;
+            bool negate = *p == '!' || *p == '^';
+            if (negate) {
+                p++;
+            }
+            bool found = false;
+            unsigned char c = *text;
+            do {
+                unsigned char low = *p == '\\' && p[1] ? *++p : *p;
+                unsigned char high = low;
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    p += 2;
+                    high = *p == '\\' && p[1] ? *++p : *p;
+                }
+                found = found || (c >= low && c <= high);
+                p++;
+            } while (*p && *p != ']');
+            if (*p != ']') {
+                // No closing bracket: '[' is literal.
+                if (*text != '[') {
+                    return false;
+                }
+                pattern++;
+                text++;
+                continue;
+            }
+            if (found == negate) {
+                return false;
+            }
+            pattern = p + 1;
+            text++;
+            continue;
+        }
+        if (*pattern == '\\' && pattern[1]) {
+            pattern++;
+        }
+        if (*pattern != *text) {
+            return false;
+        }
+        pattern++;
+        text++;
+    }
+    return *text == '\0';
+}
+
+// The part of a walked path below the listed directory.
+std::string_view relative_path(std::string_view path) {
+    if (path.compare(0, walk_root.size(), walk_root) != 0) {
+        return path;
+    }
+    path.remove_prefix(walk_root.size());
+    while (!path.empty() && path.front() == '/') {
+        path.remove_prefix(1);
+    }
+    return path;
+}
+
+std::string_view get_color_for_file(std::string_view filename, mode_t mode) {
     if (S_ISDIR(mode)) {
-        return std::string(COLOR_BOLD) + std::string(COLOR_BLUE);
+        return COLOR_BOLD COLOR_BLUE;
     }
     if (mode & S_IXUSR) {
         return COLOR_GREEN;
     }
-    std::string ext = get_file_extension(filename);
-    if (extension_colors.find(ext) != extension_colors.end()) {
-        return extension_colors[ext];
+    auto color = extension_colors.find(get_file_extension(filename));
+    if (color != extension_colors.end()) {
+        return color->second;
     }
     return COLOR_RESET;
 }
 
+void OutputBuffer::flush() {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t written = write(STDOUT_FILENO, buffer.data() + done, buffer.size() - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += written;
+    }
+    buffer.clear();
+}
+
 long parse_size(const std::string& size_str) {
     std::regex size_regex("([0-9]+)([KMGTkmgt]?[Bb]?)");
     std::smatch match;